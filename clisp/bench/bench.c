@@ -0,0 +1,767 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../libclisp/libclisp.h"
+#include "../libmpc/mpc.h"
+
+typedef struct {
+    char* name;
+    char* expr;
+    int iterations;
+    // only run when named on the command line
+    int on_request;
+    // if set, an expression for the value every iteration has to give
+    char* expect;
+} workload;
+
+static workload workloads[] = {
+    { "fib", "(fib 15)", 10 },
+    { "len", "(len {1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17 18 19 20})", 2000 },
+    { "map", "(map (\\ {x} {* x x}) {1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17 18 19 20})", 2000 },
+    { "filter", "(filter (\\ {x} {> x 10}) {1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17 18 19 20})", 2000 },
+    { "foldl", "(foldl + 0 {1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17 18 19 20})", 2000 },
+    { "call", "(day-name 6)", 2000 },
+    { "nest", "((\\ {a} {((\\ {b} {((\\ {c} {+ a b c}) 3)}) 2)}) 1)", 20000 },
+    { "arith", "(+ (* 2 3) (- 10 4) (/ 9 3) (% 7 4))", 100000 },
+    { "add", "(+ 1 2)", 100000 },
+    { "apply", "(or 1 0)", 100000 },
+    { "let", "(let {let {let {let {+ 1 2}}}})", 20000 },
+    { "str-eq", "(== s4k t4k)", 100000 },
+    { "str-ne", "(== s4k u4k)", 100000 },
+    { "len-10k", "(len l10k)", 1 },
+    { "map-10k", "(map (\\ {x} {* x x}) l10k)", 1 },
+    { "foldl-1m", "(foldl + 0 l1m)", 1, 0, "500000500000" },
+    { "len-100k", "(len l100k)", 1, 1 },
+    { "map-100k", "(map (\\ {x} {* x x}) l100k)", 1, 1 },
+};
+
+static double now_ms()
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static void print_sizes()
+{
+    int types[] = { LVAL_NUM, LVAL_ERR, LVAL_SYM, LVAL_STR, LVAL_FUN, LVAL_SEXPR, LVAL_QEXPR };
+
+    printf("allocator: %s\n", lalloc_name());
+    printf("memory: %s\n", lgc_name());
+    printf("engine: %s\n", lvm_name());
+    printf("sizeof(lval): %zu bytes\n", sizeof(lval));
+    for (int i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+        printf("  %-14s %zu bytes\n", ltype_name(types[i]), lval_size(types[i]));
+    }
+    putchar('\n');
+}
+
+// bind name to the list {1 2 ... count}
+static void define_range(lenv* env, char* name, int count)
+{
+    lval* l = lval_qexpr();
+    for (int i = 1; i <= count; i++) {
+        lval_add(l, lval_num(i));
+    }
+
+    lval* k = lval_sym(name);
+    lenv_def(env, k, l);
+    lval_del(k);
+    lval_del(l);
+}
+
+// bind name to a string of length count, ending in last
+static void define_string(lenv* env, char* name, int count, char last)
+{
+    char* s = malloc(count + 1);
+    memset(s, 'x', count - 1);
+    s[count - 1] = last;
+    s[count] = '\0';
+
+    lval* k = lval_sym(name);
+    lval* v = lval_str(s);
+    lenv_def(env, k, v);
+    lval_del(k);
+    lval_del(v);
+    free(s);
+}
+
+static lval* read_workload(lgrammar* grammar, workload* w)
+{
+    mpc_result_t r;
+    if (!mpc_parse(w->name, w->expr, grammar->lispy, &r)) {
+        mpc_err_print(r.error);
+        mpc_err_delete(r.error);
+        return NULL;
+    }
+
+    lval* program = lval_read(r.output);
+    mpc_ast_delete(r.output);
+    return program;
+}
+
+// ms taken to evaluate *program iterations times, or -1 on an error or
+// a result other than *expect, if expect is set. The caller roots
+// *program and *expect, which the gc may move between iterations.
+static double time_checked(lenv* env, lval** program, int iterations, lval** expect)
+{
+    double start = now_ms();
+    for (int i = 0; i < iterations; i++) {
+        lval* x = lval_eval(env, lval_retain(*program));
+        if (lval_type(x) == LVAL_ERR) {
+            lval_println(x);
+            lval_del(x);
+            return -1;
+        }
+        if (expect && !lval_eq(x, *expect)) {
+            printf("expected ");
+            lval_print(*expect);
+            printf(", got ");
+            lval_println(x);
+            lval_del(x);
+            return -1;
+        }
+        lval_del(x);
+    }
+    return now_ms() - start;
+}
+
+static double time_program(lenv* env, lval** program, int iterations)
+{
+    return time_checked(env, program, iterations, NULL);
+}
+
+static int run_workload(lenv* env, lgrammar* grammar, workload* w)
+{
+    lval* program = read_workload(grammar, w);
+    if (!program) {
+        return 0;
+    }
+
+    // the value the program has to give, evaluated up front
+    lval* expect = NULL;
+    if (w->expect) {
+        workload e = { w->name, w->expect, 1 };
+        expect = read_workload(grammar, &e);
+        if (!expect) {
+            lval_del(program);
+            return 0;
+        }
+        expect = lval_eval(env, expect);
+    }
+
+    // program is reused across iterations, keep it alive under the gc
+    lgc_root(&program);
+    lgc_root(&expect);
+    lgc_stats gc_start = lgc_get_stats();
+
+    double elapsed = time_checked(env, &program, w->iterations, expect ? &expect : NULL);
+    if (expect) {
+        lval_del(expect);
+        expect = NULL;
+    }
+    if (elapsed < 0) {
+        lval_del(program);
+        lgc_unroot(2);
+        return 0;
+    }
+
+    printf("%-10s %8i iterations %10.2f ms %10.2f us/iter\n",
+        w->name, w->iterations, elapsed, elapsed * 1000.0 / w->iterations);
+
+    lgc_stats gc_end = lgc_get_stats();
+    int minors = gc_end.minor_collections - gc_start.minor_collections;
+    if (minors) {
+        double pause = gc_end.minor_pause_ms - gc_start.minor_pause_ms;
+        printf("%-10s %8i minor gcs    %10.2f ms %10.2f us/pause %8zu bytes promoted\n",
+            "  gc", minors, pause, pause * 1000.0 / minors,
+            gc_end.promoted_bytes - gc_start.promoted_bytes);
+    }
+    int collections = gc_end.collections - gc_start.collections;
+    if (collections) {
+        double pause = gc_end.total_pause_ms - gc_start.total_pause_ms;
+        printf("%-10s %8i collections  %10.2f ms %10.2f us/pause\n",
+            "  gc", collections, pause, pause * 1000.0 / collections);
+    }
+
+    lval_del(program);
+    lgc_unroot(2);
+    return 1;
+}
+
+// workloads spending their time in std.lspy functions, run under both
+// engines
+static char* engine_workloads[] = { "fib", "len", "map", "filter", "foldl", "call", "nest" };
+
+static workload* find_workload(char* name)
+{
+    for (int i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++) {
+        if (strcmp(workloads[i].name, name) == 0) {
+            return &workloads[i];
+        }
+    }
+    return NULL;
+}
+
+static int bench_engines(lenv* env, lgrammar* grammar)
+{
+    int vm = lvm_enabled();
+    int stack = leval_enabled();
+    lvm_enable(1);
+    if (!lvm_enabled()) {
+        printf("engines: no vm in this build\n");
+        return 1;
+    }
+
+    printf("%-10s %14s %14s %8s %14s %8s\n", "engines", "tree-walker", "vm", "speedup", "stack", "speedup");
+    int ok = 1;
+    for (int i = 0; i < sizeof(engine_workloads) / sizeof(engine_workloads[0]); i++) {
+        workload* w = find_workload(engine_workloads[i]);
+        lval* program = read_workload(grammar, w);
+        if (!program) {
+            ok = 0;
+            continue;
+        }
+
+        lgc_root(&program);
+        leval_enable(0);
+        lvm_enable(0);
+        double tree = time_program(env, &program, w->iterations);
+        lvm_enable(1);
+        double compiled = time_program(env, &program, w->iterations);
+        leval_enable(1);
+        double stacked = time_program(env, &program, w->iterations);
+        lval_del(program);
+        lgc_unroot(1);
+        if (tree < 0 || compiled < 0 || stacked < 0) {
+            ok = 0;
+            continue;
+        }
+
+        printf("%-10s %8.2f us/iter %8.2f us/iter %7.2fx %8.2f us/iter %7.2fx\n", w->name,
+            tree * 1000.0 / w->iterations, compiled * 1000.0 / w->iterations, tree / compiled,
+            stacked * 1000.0 / w->iterations, tree / stacked);
+    }
+
+    lvm_enable(vm);
+    leval_enable(stack);
+    return ok;
+}
+
+// define the function name of x, adding up count terms. term is a
+// format given each term's index.
+static void define_sum(lenv* env, lgrammar* grammar, char* name, char* term, int count)
+{
+    char expr[4096];
+    int len = snprintf(expr, sizeof(expr), "(fun {%s x} {+", name);
+    for (int i = 1; i <= count; i++) {
+        len += snprintf(expr + len, sizeof(expr) - len, " ");
+        len += snprintf(expr + len, sizeof(expr) - len, term, i);
+    }
+    snprintf(expr + len, sizeof(expr) - len, "})");
+
+    workload w = { name, expr, 1 };
+    lval* program = read_workload(grammar, &w);
+    if (program) {
+        lval_del(lval_eval(env, program));
+    }
+}
+
+// time per vm instruction, taking the time and instructions of calls to
+// a sum of one term from those of a sum of many, which leaves out what
+// the calls themselves cost
+static int bench_dispatch(lenv* env, lgrammar* grammar)
+{
+    int vm = lvm_enabled();
+    int stack = leval_enabled();
+    lvm_enable(1);
+    leval_enable(0);
+    if (!lvm_enabled()) {
+        printf("dispatch: no vm in this build\n");
+        leval_enable(stack);
+        return 1;
+    }
+
+    char* terms[][2] = { { "const", "1" }, { "arith", "(* x %i)" } };
+    int counts[] = { 1, 64 };
+    int iterations = 100000;
+    int ok = 1;
+    for (int i = 0; i < sizeof(terms) / sizeof(terms[0]); i++) {
+        double elapsed[2];
+        long instructions[2];
+        for (int j = 0; j < 2; j++) {
+            char name[32];
+            char call[64];
+            snprintf(name, sizeof(name), "sum-%s-%i", terms[i][0], counts[j]);
+            snprintf(call, sizeof(call), "(%s 7)", name);
+            define_sum(env, grammar, name, terms[i][1], counts[j]);
+
+            workload w = { name, call, iterations };
+            lval* program = read_workload(grammar, &w);
+            if (!program) {
+                ok = 0;
+                break;
+            }
+            // the best of a few runs, as the difference is small
+            lgc_root(&program);
+            long start = lvm_get_stats().instructions;
+            elapsed[j] = time_program(env, &program, iterations);
+            instructions[j] = lvm_get_stats().instructions - start;
+            for (int run = 1; run < 5 && elapsed[j] >= 0; run++) {
+                double again = time_program(env, &program, iterations);
+                elapsed[j] = again < elapsed[j] ? again : elapsed[j];
+            }
+            lval_del(program);
+            lgc_unroot(1);
+            ok = ok && elapsed[j] >= 0;
+        }
+        if (!ok) {
+            break;
+        }
+
+        long ran = instructions[1] - instructions[0];
+        printf("%-10s %-8s %-8s %8.2f instructions/call %8.2f ns/instruction\n", "dispatch",
+            lvm_dispatch_name(), terms[i][0], (double)ran / iterations,
+            (elapsed[1] - elapsed[0]) * 1000000.0 / ran);
+    }
+
+    lvm_enable(vm);
+    leval_enable(stack);
+    return ok;
+}
+
+// recursion too deep for the C stack, a depth limit, and evaluation
+// paused every few steps, on the stack evaluator
+static int bench_stack(lenv* env, lgrammar* grammar)
+{
+    int stack = leval_enabled();
+    leval_enable(1);
+    if (!leval_enabled()) {
+        printf("stack: no stack evaluator in this build\n");
+        return 1;
+    }
+
+    int ok = 1;
+    char* deep[] = { "len-100k", "map-100k" };
+    for (int i = 0; i < sizeof(deep) / sizeof(deep[0]); i++) {
+        ok = run_workload(env, grammar, find_workload(deep[i])) && ok;
+    }
+
+    // past the limit the error comes back as the result. The conditions
+    // of select are evaluated by machines it starts, recursing in C,
+    // whose continuations count towards the same limit.
+    workload d = { "select-depth", "(fun {select-depth n} {select {(== n 0) 1} {(select-depth (- n 1)) 1}})", 1 };
+    lval* program = read_workload(grammar, &d);
+    if (program) {
+        lval_del(lval_eval(env, program));
+    }
+    workload limited[] = { *find_workload("len-100k"), { "select-100k", "(select-depth 100000)", 1 } };
+    lval* x = NULL;
+    for (int i = 0; i < sizeof(limited) / sizeof(limited[0]); i++) {
+        program = read_workload(grammar, &limited[i]);
+        if (!program) {
+            ok = 0;
+            continue;
+        }
+        leval_set_limit(10000);
+        x = lval_eval(env, lval_retain(program));
+        leval_set_limit(0);
+        printf("%-10s %-11s %8i continuations ", "limit", limited[i].name, 10000);
+        lval_println(x);
+        ok = ok && lval_type(x) == LVAL_ERR;
+        lval_del(x);
+        lval_del(program);
+    }
+
+    // the same evaluation run straight through and in slices
+    workload* w = find_workload("fib");
+    program = read_workload(grammar, w);
+    lgc_root(&program);
+    double straight = time_program(env, &program, w->iterations);
+    for (long steps = 10; straight >= 0 && steps <= 10000; steps *= 10) {
+        long slices = 0;
+        double start = now_ms();
+        for (int i = 0; i < w->iterations; i++) {
+            leval* s = leval_new(env, lval_retain(program));
+            while (!(x = leval_run(s, steps))) {
+                slices++;
+            }
+            leval_del(s);
+            lval_del(x);
+        }
+        double elapsed = now_ms() - start;
+        printf("%-10s %8li steps/slice %8li slices %10.2f us/iter %7.2fx\n", "pause", steps,
+            slices / w->iterations, elapsed * 1000.0 / w->iterations, straight / elapsed);
+    }
+    lval_del(program);
+    lgc_unroot(1);
+
+    leval_enable(stack);
+    return ok && straight >= 0;
+}
+
+// calls of functions defined with their bodies folded and not, on the
+// tree-walker and the vm, checked against the result they should give.
+// Each has a definition and a call, with %s for its name.
+static int bench_fold(lenv* env, lgrammar* grammar)
+{
+    int vm = lvm_enabled();
+    int stack = leval_enabled();
+    int fold = lval_fold_enabled();
+    leval_enable(0);
+
+    char* funs[][4] = {
+        { "consts", "(fun {%s x} {+ x (* 60 60 24) (- 10 (/ 100 10)) (if (> 2 1) {1} {0})})", "(%s 7)", "86408" },
+        { "globals", "(fun {%s l} {if (== l nil) {0} {+ 1 (%s (tail l))}})", "(%s {1 2 3 4 5 6 7 8 9 10})", "10" },
+    };
+    int iterations = 20000;
+    int ok = 1;
+    for (int engine = 0; engine < 2 && ok; engine++) {
+        lvm_enable(engine);
+        if (engine && !lvm_enabled()) {
+            printf("fold: no vm in this build\n");
+            break;
+        }
+        for (int i = 0; i < sizeof(funs) / sizeof(funs[0]); i++) {
+            double elapsed[2];
+            for (int on = 0; on < 2; on++) {
+                char name[32];
+                char expr[256];
+                char call[64];
+                snprintf(name, sizeof(name), "fold-%s-%i-%i", funs[i][0], engine, on);
+                snprintf(expr, sizeof(expr), funs[i][1], name, name);
+                snprintf(call, sizeof(call), funs[i][2], name);
+
+                lval_fold_enable(on);
+                workload d = { name, expr, 1 };
+                lval* program = read_workload(grammar, &d);
+                if (program) {
+                    lval_del(lval_eval(env, program));
+                }
+
+                // a number, which the gc has nothing to move of
+                lval* expect = lval_num(atol(funs[i][3]));
+                workload w = { name, call, iterations };
+                program = read_workload(grammar, &w);
+                lgc_root(&program);
+                elapsed[on] = program ? time_checked(env, &program, iterations, &expect) : -1;
+                if (program) {
+                    lval_del(program);
+                }
+                lval_del(expect);
+                lgc_unroot(1);
+                ok = ok && elapsed[on] >= 0;
+            }
+            if (!ok) {
+                break;
+            }
+            printf("%-10s %-11s %-8s %8.2f us/call unfolded %8.2f us/call folded %7.2fx\n", "fold",
+                lvm_name(), funs[i][0], elapsed[0] * 1000.0 / iterations,
+                elapsed[1] * 1000.0 / iterations, elapsed[0] / elapsed[1]);
+        }
+    }
+
+    lval_fold_enable(fold);
+    lvm_enable(vm);
+    leval_enable(stack);
+    return ok;
+}
+
+// calls of functions using the small ones in std.lspy, defined with
+// inlining and without, on the tree-walker and the vm: the lambda calls
+// each call makes and the time it takes. first can't be inlined, as the
+// eval in it runs the item in its frame.
+static int bench_inline(lenv* env, lgrammar* grammar)
+{
+    int vm = lvm_enabled();
+    int stack = leval_enabled();
+    leval_enable(0);
+
+    char* funs[][3] = {
+        { "logic", "(fun {%s x y} {and (or x y) (not (and x y))})", "(%s 1 0)" },
+        { "map", "(fun {%s l} {map (\\ {x} {and (not x) (or x 1)}) l})", "(%s {0 1 0 1 0 1 0 1 0 1})" },
+        { "sum", "(fun {%s l} {+ (sum l) (product l)})", "(%s {1 2 3 4 5 6 7 8 9 10})" },
+        { "first", "(fun {%s l} {+ (first l) (second l)})", "(%s {1 2 3 4 5 6 7 8 9 10})" },
+    };
+    int iterations = 20000;
+    int ok = 1;
+    for (int engine = 0; engine < 2 && ok; engine++) {
+        lvm_enable(engine);
+        if (engine && !lvm_enabled()) {
+            printf("inline: no vm in this build\n");
+            break;
+        }
+        for (int i = 0; i < sizeof(funs) / sizeof(funs[0]); i++) {
+            double elapsed[2];
+            long calls[2];
+            for (int on = 0; on < 2; on++) {
+                char name[32];
+                char expr[256];
+                char call[64];
+                snprintf(name, sizeof(name), "inline-%s-%i-%i", funs[i][0], engine, on);
+                snprintf(expr, sizeof(expr), funs[i][1], name);
+                snprintf(call, sizeof(call), funs[i][2], name);
+
+                lval_set_inline_budget(on ? LVAL_INLINE_BUDGET : 0);
+                workload d = { name, expr, 1 };
+                lval* program = read_workload(grammar, &d);
+                if (program) {
+                    lval_del(lval_eval(env, program));
+                }
+
+                workload w = { name, call, iterations };
+                program = read_workload(grammar, &w);
+                lgc_root(&program);
+                long start = lval_get_call_stats().calls;
+                elapsed[on] = program ? time_program(env, &program, iterations) : -1;
+                calls[on] = lval_get_call_stats().calls - start;
+                if (program) {
+                    lval_del(program);
+                }
+                lgc_unroot(1);
+                ok = ok && elapsed[on] >= 0;
+            }
+            if (!ok) {
+                break;
+            }
+            printf("%-10s %-11s %-8s %6.2f calls/iter %6.2f with inlining %6.2f eliminated %8.2f us/iter %8.2f us/iter %7.2fx\n",
+                "inline", lvm_name(), funs[i][0], (double)calls[0] / iterations, (double)calls[1] / iterations,
+                (double)(calls[0] - calls[1]) / iterations, elapsed[0] * 1000.0 / iterations,
+                elapsed[1] * 1000.0 / iterations, elapsed[0] / elapsed[1]);
+        }
+    }
+
+    lval_set_inline_budget(LVAL_INLINE_BUDGET);
+    lvm_enable(vm);
+    leval_enable(stack);
+    return ok;
+}
+
+// if, do and let as special forms and builtins, against how they ran
+// before on the tree-walker: if applied to Q-expressions it is passed in
+// variables, as it then always was, and do and let as std.lspy defined
+// them
+static int bench_forms(lenv* env, lgrammar* grammar)
+{
+    int vm = lvm_enabled();
+    int stack = leval_enabled();
+    lvm_enable(0);
+    leval_enable(0);
+
+    char* defs[] = {
+        "(def {if-then if-else} {+ 1 2} {+ 3 4})",
+        "(fun {std-do & l} {if (== l nil) {nil} {last l}})",
+        "(fun {std-let b} {((\\ {_} b) ())})",
+    };
+    for (int i = 0; i < sizeof(defs) / sizeof(defs[0]); i++) {
+        workload d = { "forms", defs[i], 1 };
+        lval* program = read_workload(grammar, &d);
+        if (program) {
+            lval_del(lval_eval(env, program));
+        }
+    }
+
+    char* exprs[][3] = {
+        { "if", "(if 1 if-then if-else)", "(if 1 {+ 1 2} {+ 3 4})" },
+        { "do", "(std-do 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16)", "(do 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16)" },
+        { "let", "(std-let {std-let {+ 1 2}})", "(let {let {+ 1 2}})" },
+    };
+    int iterations = 20000;
+    int ok = 1;
+    for (int i = 0; i < sizeof(exprs) / sizeof(exprs[0]); i++) {
+        double elapsed[2];
+        for (int form = 0; form < 2; form++) {
+            workload w = { exprs[i][0], exprs[i][1 + form], iterations };
+            lval* program = read_workload(grammar, &w);
+            lgc_root(&program);
+            elapsed[form] = program ? time_program(env, &program, iterations) : -1;
+            if (program) {
+                lval_del(program);
+            }
+            lgc_unroot(1);
+            ok = ok && elapsed[form] >= 0;
+        }
+        if (!ok) {
+            break;
+        }
+        printf("%-10s %-8s %8.2f us/iter before %8.2f us/iter native %7.2fx\n", "forms",
+            exprs[i][0], elapsed[0] * 1000.0 / iterations, elapsed[1] * 1000.0 / iterations,
+            elapsed[0] / elapsed[1]);
+    }
+
+    lvm_enable(vm);
+    leval_enable(stack);
+    return ok;
+}
+
+// the arithmetic and comparison builtins called straight from C, on two
+// numbers and on a thousand
+static int bench_kernels(lenv* env, lgrammar* grammar)
+{
+    struct {
+        char* name;
+        lbuiltin builtin;
+        int count;
+    } kernels[] = {
+        { "+", builtin_add, 2 },
+        { "-", builtin_sub, 2 },
+        { "*", builtin_mul, 2 },
+        { "<", builtin_lt, 2 },
+        { "==", builtin_eq, 2 },
+        { "+", builtin_add, 1000 },
+        { "*", builtin_mul, 1000 },
+    };
+
+    for (int i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+        int count = kernels[i].count;
+        lval* a = lval_sexpr();
+        for (int j = 0; j < count; j++) {
+            lval_add(a, lval_num(count == 2 ? j + 1 : 1));
+        }
+
+        // the builtin takes a reference to the arguments, not the list
+        int calls = 2000000 / count;
+        double start = now_ms();
+        for (int j = 0; j < calls; j++) {
+            lval_del(kernels[i].builtin(env, lval_retain(a)));
+        }
+        double elapsed = now_ms() - start;
+
+        // and through lval_call, which checks the builtin's signature
+        lval* k = lval_sym(kernels[i].name);
+        lval* f = lenv_get(env, k);
+        start = now_ms();
+        for (int j = 0; j < calls; j++) {
+            lval_del(lval_call(env, f, lval_retain(a)));
+        }
+        double checked = now_ms() - start;
+        lval_del(f);
+        lval_del(k);
+        lval_del(a);
+
+        printf("%-10s %-2s %6i args %9.2f ns/call %10.2f ns/arg %9.2f ns/call checked\n", "kernel",
+            kernels[i].name, count, elapsed * 1000000.0 / calls, elapsed * 1000000.0 / calls / count,
+            checked * 1000000.0 / calls);
+    }
+    return 1;
+}
+
+// time lenv_get of the most recent global as definitions are added
+static int bench_lookup(lenv* env, lgrammar* grammar)
+{
+    lenv* globals = lenv_new(grammar->lispy);
+    int lookups = 1000000;
+    int defined = 0;
+
+    for (int n = 16; n <= 16384; n *= 4) {
+        char name[32];
+        for (; defined < n; defined++) {
+            snprintf(name, sizeof(name), "global-%i", defined);
+            lval* k = lval_sym(name);
+            lval* v = lval_num(defined);
+            lenv_put(globals, k, v);
+            lval_del(k);
+            lval_del(v);
+        }
+
+        lval* k = lval_sym(name);
+
+        double start = now_ms();
+        for (int i = 0; i < lookups; i++) {
+            lval_del(lenv_get(globals, k));
+        }
+        double elapsed = now_ms() - start;
+        lval_del(k);
+
+        printf("%-10s %8i definitions %9.2f ms %10.2f ns/lookup\n",
+            "lookup", n, elapsed, elapsed * 1000000.0 / lookups);
+    }
+
+    lenv_del(globals);
+    return 1;
+}
+
+// run the section bench after a blank line, if it is named on the
+// command line or nothing is. Returns whether it passed.
+static int run_section(int argc, char** argv, char* name, int (*bench)(lenv*, lgrammar*), lenv* env,
+    lgrammar* grammar)
+{
+    int selected = argc == 1;
+    for (int j = 1; j < argc; j++) {
+        selected = selected || strcmp(argv[j], name) == 0;
+    }
+    if (!selected) {
+        return 1;
+    }
+    putchar('\n');
+    return bench(env, grammar);
+}
+
+int main(int argc, char** argv)
+{
+    lgrammar* grammar = lgrammar_new();
+    lenv* env = lenv_new(grammar->lispy);
+
+    lenv_add_default_builtins(env, grammar);
+
+    lval* result = lval_load(env, "lib/std.lspy");
+    if (lval_type(result) == LVAL_ERR) {
+        lval_println(result);
+    }
+    lval_del(result);
+
+    define_range(env, "l10k", 10000);
+    define_range(env, "l100k", 100000);
+    define_range(env, "l1m", 1000000);
+    define_string(env, "s4k", 4096, 'x');
+    define_string(env, "t4k", 4096, 'x');
+    define_string(env, "u4k", 4096, 'y');
+
+    print_sizes();
+    printf("interned symbols: %i\n\n", lsym_count());
+
+    int ok = 1;
+    for (int i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++) {
+        // optionally restrict to workloads named on the command line
+        int selected = argc == 1 && !workloads[i].on_request;
+        for (int j = 1; j < argc; j++) {
+            if (strcmp(argv[j], workloads[i].name) == 0) {
+                selected = 1;
+            }
+        }
+        if (selected) {
+            ok = run_workload(env, grammar, &workloads[i]) && ok;
+        }
+    }
+
+    ok = run_section(argc, argv, "engines", bench_engines, env, grammar) && ok;
+    ok = run_section(argc, argv, "dispatch", bench_dispatch, env, grammar) && ok;
+    ok = run_section(argc, argv, "stack", bench_stack, env, grammar) && ok;
+    ok = run_section(argc, argv, "fold", bench_fold, env, grammar) && ok;
+    ok = run_section(argc, argv, "inline", bench_inline, env, grammar) && ok;
+    ok = run_section(argc, argv, "forms", bench_forms, env, grammar) && ok;
+    ok = run_section(argc, argv, "kernels", bench_kernels, env, grammar) && ok;
+    ok = run_section(argc, argv, "lookup", bench_lookup, env, grammar) && ok;
+
+    lenv_cache_stats cache = lenv_get_cache_stats();
+    long lookups = cache.hits + cache.misses;
+    if (lookups) {
+        printf("\nglobal lookup cache: %li hits, %li misses, %.2f%% hit rate\n",
+            cache.hits, cache.misses, 100.0 * cache.hits / lookups);
+    }
+
+    lgc_stats gc = lgc_get_stats();
+    if (gc.collections || gc.minor_collections) {
+        printf("\ngc: %i minor, %i full collections, max pause %.2f ms, %zu bytes live after last\n",
+            gc.minor_collections, gc.collections, gc.max_pause_ms, gc.live_bytes);
+    }
+
+    lenv_del(env);
+    lgrammar_del(grammar);
+    lgc_release();
+    lsym_release();
+    lalloc_release();
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,188 @@
+#include <stdlib.h>
+
+#include "lalloc.h"
+
+// chunks of the frame stack, a chunk is at least this big
+#define LALLOC_CHUNK_SIZE (256 * 1024)
+
+typedef struct lchunk {
+    struct lchunk* prev;
+    char* top;
+    char* end;
+} lchunk;
+
+static _Thread_local lchunk* stack;
+
+// the most recently emptied chunk is kept, so a call on a chunk boundary
+// doesn't allocate every time
+static _Thread_local lchunk* spare;
+
+void* lalloc_push(size_t size)
+{
+    size = (size + 7) & ~(size_t)7;
+    if (!stack || stack->top + size > stack->end) {
+        lchunk* chunk = spare;
+        if (chunk && chunk->end - (char*)(chunk + 1) >= (ptrdiff_t)size) {
+            spare = NULL;
+        } else {
+            size_t bytes = sizeof(lchunk) + size;
+            if (bytes < LALLOC_CHUNK_SIZE) {
+                bytes = LALLOC_CHUNK_SIZE;
+            }
+            chunk = malloc(bytes);
+            chunk->end = (char*)chunk + bytes;
+        }
+        chunk->prev = stack;
+        chunk->top = (char*)(chunk + 1);
+        stack = chunk;
+    }
+
+    void* p = stack->top;
+    stack->top += size;
+    return p;
+}
+
+void lalloc_pop(void* p)
+{
+    // drop whole chunks until the one holding p is on top
+    while ((char*)p < (char*)(stack + 1) || (char*)p >= stack->end) {
+        lchunk* prev = stack->prev;
+        free(spare);
+        spare = stack;
+        stack = prev;
+    }
+    stack->top = p;
+}
+
+static void lalloc_release_stack(void)
+{
+    while (stack) {
+        lchunk* prev = stack->prev;
+        free(stack);
+        stack = prev;
+    }
+    free(spare);
+    spare = NULL;
+}
+
+#ifdef CLISP_SLAB_ALLOC
+
+// size classes are multiples of 8 bytes, anything larger goes to malloc
+#define LALLOC_ALIGN 8
+#define LALLOC_MAX_SIZE 128
+#define LALLOC_CLASSES (LALLOC_MAX_SIZE / LALLOC_ALIGN)
+#define LALLOC_SLAB_SIZE (64 * 1024)
+
+typedef struct lslab {
+    struct lslab* next;
+} lslab;
+
+typedef struct lfree {
+    struct lfree* next;
+} lfree;
+
+typedef struct lpool {
+    // free nodes for each size class
+    lfree* free[LALLOC_CLASSES];
+
+    // every slab owned by this thread, for bulk release
+    lslab* slabs;
+
+    // unused tail of the most recent slab
+    char* cursor;
+    char* end;
+} lpool;
+
+static _Thread_local lpool pool;
+
+static int lalloc_class(size_t size)
+{
+    return (int)((size + LALLOC_ALIGN - 1) / LALLOC_ALIGN) - 1;
+}
+
+static void* lalloc_carve(size_t size)
+{
+    if (pool.cursor + size > pool.end) {
+        // the remainder of the current slab is abandoned until release
+        lslab* slab = malloc(LALLOC_SLAB_SIZE);
+        slab->next = pool.slabs;
+        pool.slabs = slab;
+        pool.cursor = (char*)slab + sizeof(lslab);
+        pool.end = (char*)slab + LALLOC_SLAB_SIZE;
+    }
+    void* p = pool.cursor;
+    pool.cursor += size;
+    return p;
+}
+
+void* lalloc(size_t size)
+{
+    if (size > LALLOC_MAX_SIZE) {
+        return malloc(size);
+    }
+
+    int c = lalloc_class(size);
+    lfree* node = pool.free[c];
+    if (node) {
+        pool.free[c] = node->next;
+        return node;
+    }
+    return lalloc_carve((size_t)(c + 1) * LALLOC_ALIGN);
+}
+
+void lalloc_free(void* p, size_t size)
+{
+    if (size > LALLOC_MAX_SIZE) {
+        free(p);
+        return;
+    }
+
+    int c = lalloc_class(size);
+    lfree* node = p;
+    node->next = pool.free[c];
+    pool.free[c] = node;
+}
+
+void lalloc_release(void)
+{
+    lalloc_release_stack();
+    while (pool.slabs) {
+        lslab* next = pool.slabs->next;
+        free(pool.slabs);
+        pool.slabs = next;
+    }
+    for (int i = 0; i < LALLOC_CLASSES; i++) {
+        pool.free[i] = NULL;
+    }
+    pool.cursor = NULL;
+    pool.end = NULL;
+}
+
+char* lalloc_name(void)
+{
+    return "slab";
+}
+
+#else
+
+void* lalloc(size_t size)
+{
+    return malloc(size);
+}
+
+void lalloc_free(void* p, size_t size)
+{
+    free(p);
+}
+
+void lalloc_release(void)
+{
+    lalloc_release_stack();
+}
+
+char* lalloc_name(void)
+{
+    return "malloc";
+}
+
+#endif
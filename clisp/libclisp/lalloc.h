@@ -0,0 +1,28 @@
+#ifndef LIB_CLISP_LALLOC_H
+#define LIB_CLISP_LALLOC_H
+
+#include <stddef.h>
+
+///////////////////////////////////////////////////////////////////////
+
+// Allocator for the interpreter's small fixed-size nodes (lval, lenv).
+// Built with CLISP_SLAB_ALLOC it carves nodes out of per-thread slabs,
+// one free list per 8 byte size class; otherwise it forwards to malloc.
+// Nodes must be freed with the size they were allocated with.
+
+void* lalloc(size_t size);
+void lalloc_free(void* p, size_t size);
+
+// Stack allocation for call frames, carved from per-thread chunks.
+// lalloc_pop releases p and everything pushed after it, so frames must
+// be popped in the reverse of the order they were pushed.
+void* lalloc_push(size_t size);
+void lalloc_pop(void* p);
+
+// Return every slab and stack chunk owned by the calling thread to the
+// system. Any node still allocated on this thread is invalidated.
+void lalloc_release(void);
+
+char* lalloc_name(void);
+
+#endif
@@ -0,0 +1,502 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libclisp.h"
+
+static lgc_stats stats;
+
+#ifdef CLISP_GC
+
+// collect once this many bytes have been allocated since the last
+// collection, or twice the live heap, whichever is larger
+#define LGC_MIN_THRESHOLD (1 << 20)
+
+// every allocation is preceded by a header linking it into the heap
+typedef struct lgc_object {
+    struct lgc_object* next;
+    int kind;
+    int flags;
+} lgc_object;
+
+enum {
+    LGC_MARKED = 1,
+    LGC_REMEMBERED = 2,
+    LGC_FORWARDED = 4
+};
+
+typedef struct lgc_ref {
+    int kind;
+    void* ptr;
+} lgc_ref;
+
+typedef struct lgc_stack {
+    lgc_ref* refs;
+    int count;
+    int capacity;
+} lgc_stack;
+
+static lgc_object* objects = NULL;
+static size_t allocated = 0;
+static size_t threshold = LGC_MIN_THRESHOLD;
+
+// root stack holds lval** (so roots see reassignment) and lenv*
+static lgc_stack roots;
+
+// work list for marking, holds lval* and lenv*
+static lgc_stack grey;
+
+#ifdef CLISP_GC_NURSERY
+
+// lvals are bump allocated here and promoted into the mark-sweep heap
+// when they survive a minor collection; lenvs always live in the heap
+#define LGC_NURSERY_SIZE (256 * 1024)
+
+// a minor collection is due once this much of the nursery is in use.
+// Allocations which don't fit go straight to the heap.
+#define LGC_NURSERY_TRIGGER (LGC_NURSERY_SIZE / 4 * 3)
+
+static char* nursery = NULL;
+static char* nursery_cursor = NULL;
+static char* nursery_end = NULL;
+
+// heap objects which may point into the nursery
+static lgc_stack remembered;
+
+#endif
+
+static double lgc_now_ms()
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static void lgc_stack_push(lgc_stack* s, int kind, void* ptr)
+{
+    if (s->count == s->capacity) {
+        s->capacity = s->capacity ? s->capacity * 2 : 256;
+        s->refs = realloc(s->refs, sizeof(lgc_ref) * s->capacity);
+    }
+    s->refs[s->count].kind = kind;
+    s->refs[s->count].ptr = ptr;
+    s->count++;
+}
+
+static size_t lgc_object_size(lgc_object* o)
+{
+    if (o->kind == LGC_LENV) {
+        return sizeof(lgc_object) + sizeof(lenv);
+    }
+    if (o->kind == LGC_CELLS) {
+        return sizeof(lgc_object) + sizeof(lcells);
+    }
+    return sizeof(lgc_object) + lval_size(((lval*)(o + 1))->type);
+}
+
+static void* lgc_alloc_heap(size_t size, int kind)
+{
+    lgc_object* o = lalloc(sizeof(lgc_object) + size);
+    o->next = objects;
+    o->kind = kind;
+    o->flags = 0;
+    objects = o;
+
+    allocated += sizeof(lgc_object) + size;
+    return o + 1;
+}
+
+static void lgc_finalize(lgc_object* o)
+{
+    if (o->kind == LGC_LENV) {
+        lenv* e = (lenv*)(o + 1);
+        free(e->syms);
+        free(e->index);
+        return;
+    }
+    if (o->kind == LGC_CELLS) {
+        free(((lcells*)(o + 1))->items);
+        return;
+    }
+
+    lval* v = (lval*)(o + 1);
+    switch (v->type) {
+    case LVAL_ERR:
+        free(v->err);
+        break;
+    case LVAL_STR:
+        lval_str_release(v);
+        break;
+    }
+}
+
+#ifdef CLISP_GC_NURSERY
+
+static int lgc_is_young(void* p)
+{
+    return (char*)p >= nursery && (char*)p < nursery_end;
+}
+
+static void lgc_remember(int kind, void* ptr)
+{
+    lgc_object* o = (lgc_object*)ptr - 1;
+    if (!(o->flags & LGC_REMEMBERED)) {
+        o->flags |= LGC_REMEMBERED;
+        lgc_stack_push(&remembered, kind, ptr);
+    }
+}
+
+void* lgc_alloc(size_t size, int kind)
+{
+    if (!nursery) {
+        nursery = malloc(LGC_NURSERY_SIZE);
+        nursery_cursor = nursery;
+        nursery_end = nursery + LGC_NURSERY_SIZE;
+    }
+
+    if (kind == LGC_LVAL && nursery_cursor + sizeof(lgc_object) + size <= nursery_end) {
+        lgc_object* o = (lgc_object*)nursery_cursor;
+        nursery_cursor += sizeof(lgc_object) + size;
+        o->next = NULL;
+        o->kind = kind;
+        o->flags = 0;
+        return o + 1;
+    }
+
+    // the nursery is full (or this is an env or cell buffer). A new lval
+    // or buffer is about to have young children stored into it, so
+    // remember it up front.
+    void* p = lgc_alloc_heap(size, kind);
+    if (kind != LGC_LENV) {
+        lgc_remember(kind, p);
+    }
+    return p;
+}
+
+void lgc_barrier(void* obj, int kind, lval* value)
+{
+    if (!lval_is_fixnum(value) && lgc_is_young(value) && !lgc_is_young(obj)) {
+        lgc_remember(kind, obj);
+    }
+}
+
+// copy a young lval into the heap, leaving a forwarding pointer behind
+static lval* lgc_evacuate(lval* v)
+{
+    if (!v || lval_is_fixnum(v) || !lgc_is_young(v)) {
+        return v;
+    }
+
+    lgc_object* o = (lgc_object*)v - 1;
+    if (o->flags & LGC_FORWARDED) {
+        return (lval*)o->next;
+    }
+
+    size_t size = lval_size(v->type);
+    lval* x = lgc_alloc_heap(size, LGC_LVAL);
+    memcpy(x, v, size);
+    o->flags |= LGC_FORWARDED;
+    o->next = (lgc_object*)x;
+
+    stats.promoted_bytes += sizeof(lgc_object) + size;
+
+    // its children are scanned once the roots are done
+    lgc_stack_push(&grey, LGC_LVAL, x);
+    return x;
+}
+
+static void lgc_scan(int kind, void* ptr)
+{
+    if (kind == LGC_LENV) {
+        lenv* e = ptr;
+        for (int i = 0; i < e->count; i++) {
+            e->vals[i] = lgc_evacuate(e->vals[i]);
+        }
+        return;
+    }
+    if (kind == LGC_CELLS) {
+        lcells* c = ptr;
+        for (int i = c->lo; i < c->hi; i++) {
+            c->items[i] = lgc_evacuate(c->items[i]);
+        }
+        return;
+    }
+
+    // buffers never move, so a list has nothing young of its own
+    lval* v = ptr;
+    if (v->type == LVAL_FUN && !v->builtin) {
+        v->formals = lgc_evacuate(v->formals);
+        v->body = lgc_evacuate(v->body);
+        v->folded = lgc_evacuate(v->folded);
+    }
+}
+
+static void lgc_collect_minor()
+{
+    double start = lgc_now_ms();
+
+    for (int i = 0; i < roots.count; i++) {
+        if (roots.refs[i].kind == LGC_LVAL) {
+            lval** slot = roots.refs[i].ptr;
+            *slot = lgc_evacuate(*slot);
+        }
+    }
+
+    for (int i = 0; i < remembered.count; i++) {
+        lgc_object* o = (lgc_object*)remembered.refs[i].ptr - 1;
+        o->flags &= ~LGC_REMEMBERED;
+        lgc_scan(remembered.refs[i].kind, remembered.refs[i].ptr);
+    }
+    remembered.count = 0;
+
+    while (grey.count) {
+        lgc_ref ref = grey.refs[--grey.count];
+        lgc_scan(ref.kind, ref.ptr);
+    }
+
+    // everything left behind is dead; release what it owns
+    char* p = nursery;
+    while (p < nursery_cursor) {
+        lgc_object* o = (lgc_object*)p;
+        p += lgc_object_size(o);
+        if (!(o->flags & LGC_FORWARDED)) {
+            lgc_finalize(o);
+        }
+    }
+    nursery_cursor = nursery;
+
+    double pause = lgc_now_ms() - start;
+    stats.minor_collections++;
+    stats.minor_pause_ms += pause;
+    if (pause > stats.max_pause_ms) {
+        stats.max_pause_ms = pause;
+    }
+}
+
+#else
+
+void* lgc_alloc(size_t size, int kind)
+{
+    return lgc_alloc_heap(size, kind);
+}
+
+#endif
+
+static void lgc_grey(int kind, void* ptr)
+{
+    if (!ptr || (kind == LGC_LVAL && lval_is_fixnum(ptr))) {
+        return;
+    }
+
+    lgc_object* o = (lgc_object*)ptr - 1;
+    if (!(o->flags & LGC_MARKED)) {
+        o->flags |= LGC_MARKED;
+        lgc_stack_push(&grey, kind, ptr);
+    }
+}
+
+static void lgc_mark()
+{
+    for (int i = 0; i < roots.count; i++) {
+        if (roots.refs[i].kind == LGC_LENV) {
+            lgc_grey(LGC_LENV, roots.refs[i].ptr);
+        } else {
+            lgc_grey(LGC_LVAL, *(lval**)roots.refs[i].ptr);
+        }
+    }
+
+    while (grey.count) {
+        lgc_ref ref = grey.refs[--grey.count];
+
+        if (ref.kind == LGC_LENV) {
+            lenv* e = ref.ptr;
+            lgc_grey(LGC_LENV, e->parent);
+            for (int i = 0; i < e->count; i++) {
+                lgc_grey(LGC_LVAL, e->vals[i]);
+            }
+            continue;
+        }
+        if (ref.kind == LGC_CELLS) {
+            lcells* c = ref.ptr;
+            for (int i = c->lo; i < c->hi; i++) {
+                lgc_grey(LGC_LVAL, c->items[i]);
+            }
+            continue;
+        }
+
+        lval* v = ref.ptr;
+        switch (v->type) {
+        case LVAL_FUN:
+            if (!v->builtin) {
+                lgc_grey(LGC_LENV, v->env);
+                lgc_grey(LGC_LVAL, v->formals);
+                lgc_grey(LGC_LVAL, v->body);
+                lgc_grey(LGC_LVAL, v->folded);
+            }
+            break;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            lgc_grey(LGC_CELLS, v->buf);
+            break;
+        }
+    }
+}
+
+static void lgc_sweep()
+{
+    size_t live = 0;
+    lgc_object** link = &objects;
+    while (*link) {
+        lgc_object* o = *link;
+        size_t size = lgc_object_size(o);
+        if (o->flags & LGC_MARKED) {
+            o->flags &= ~LGC_MARKED;
+            live += size;
+            link = &o->next;
+        } else {
+            *link = o->next;
+            lgc_finalize(o);
+            lalloc_free(o, size);
+            stats.freed_bytes += size;
+        }
+    }
+
+    stats.live_bytes = live;
+    allocated = 0;
+    threshold = live * 2 > LGC_MIN_THRESHOLD ? live * 2 : LGC_MIN_THRESHOLD;
+}
+
+void lgc_root(lval** v)
+{
+    lgc_stack_push(&roots, LGC_LVAL, v);
+}
+
+void lgc_root_env(lenv* e)
+{
+    lgc_stack_push(&roots, LGC_LENV, e);
+}
+
+void lgc_unroot(int count)
+{
+    roots.count -= count;
+}
+
+static void lgc_collect_major()
+{
+    double start = lgc_now_ms();
+
+    lgc_mark();
+    lgc_sweep();
+
+    double pause = lgc_now_ms() - start;
+    stats.collections++;
+    stats.total_pause_ms += pause;
+    if (pause > stats.max_pause_ms) {
+        stats.max_pause_ms = pause;
+    }
+}
+
+void lgc_collect(void)
+{
+#ifdef CLISP_GC_NURSERY
+    // empty the nursery first, so marking only has to look at the heap
+    lgc_collect_minor();
+#endif
+    lgc_collect_major();
+}
+
+void lgc_safepoint(lenv* e, lval** v)
+{
+#ifdef CLISP_GC_NURSERY
+    int minor = nursery_cursor - nursery >= LGC_NURSERY_TRIGGER;
+#else
+    int minor = 0;
+#endif
+    if (!minor && allocated < threshold) {
+        return;
+    }
+
+    lgc_root_env(e);
+    lgc_root(v);
+#ifdef CLISP_GC_NURSERY
+    lgc_collect_minor();
+#endif
+    if (allocated >= threshold) {
+        lgc_collect_major();
+    }
+    lgc_unroot(2);
+}
+
+void lgc_release(void)
+{
+#ifdef CLISP_GC_NURSERY
+    char* p = nursery;
+    while (p < nursery_cursor) {
+        lgc_object* o = (lgc_object*)p;
+        p += lgc_object_size(o);
+        lgc_finalize(o);
+    }
+    free(nursery);
+    free(remembered.refs);
+    memset(&remembered, 0, sizeof(remembered));
+    nursery = nursery_cursor = nursery_end = NULL;
+#endif
+
+    while (objects) {
+        lgc_object* o = objects;
+        objects = o->next;
+        size_t size = lgc_object_size(o);
+        lgc_finalize(o);
+        lalloc_free(o, size);
+    }
+
+    free(roots.refs);
+    free(grey.refs);
+    memset(&roots, 0, sizeof(roots));
+    memset(&grey, 0, sizeof(grey));
+    allocated = 0;
+    threshold = LGC_MIN_THRESHOLD;
+}
+
+char* lgc_name(void)
+{
+#ifdef CLISP_GC_NURSERY
+    return "generational";
+#else
+    return "mark-sweep";
+#endif
+}
+
+#else
+
+void lgc_root(lval** v)
+{
+}
+
+void lgc_root_env(lenv* e)
+{
+}
+
+void lgc_unroot(int count)
+{
+}
+
+void lgc_collect(void)
+{
+}
+
+void lgc_release(void)
+{
+}
+
+char* lgc_name(void)
+{
+    return "refcount";
+}
+
+#endif
+
+lgc_stats lgc_get_stats(void)
+{
+    return stats;
+}
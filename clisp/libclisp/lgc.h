@@ -0,0 +1,91 @@
+#ifndef LIB_CLISP_LGC_H
+#define LIB_CLISP_LGC_H
+
+#include <stddef.h>
+
+///////////////////////////////////////////////////////////////////////
+
+struct lval;
+struct lenv;
+
+// Precise mark-sweep collector, used instead of reference counting when
+// libclisp is built with CLISP_GC (meson -Dmemory=gc). In that mode
+// lval_del and lenv_del do nothing and every lval and lenv is reclaimed
+// by the collector once it can't be reached from a root.
+//
+// With CLISP_GC_NURSERY as well (meson -Dmemory=generational) new lvals
+// are bump allocated in a nursery. A minor collection copies the ones
+// still reachable into the mark-sweep heap and updates every reference
+// to them, so lvals move: a pointer held in C across lval_eval is only
+// valid if its slot was rooted. Stores which may make a heap object
+// point into the nursery go through LGC_BARRIER.
+//
+// Roots are the values and envs pushed onto the root stack. The
+// evaluator roots its own state; code outside libclisp only needs to
+// root values it holds across a call to lval_eval. Collection happens
+// at the start of lval_eval, never inside an allocation.
+//
+// In a reference counted build these functions do nothing.
+
+void lgc_root(struct lval** v);
+void lgc_root_env(struct lenv* e);
+void lgc_unroot(int count);
+
+void lgc_collect(void);
+
+// Free every object the collector owns, reachable or not.
+void lgc_release(void);
+
+typedef struct lgc_stats {
+    int collections;
+    size_t live_bytes;
+    size_t freed_bytes;
+    double total_pause_ms;
+    double max_pause_ms;
+
+    // nursery
+    int minor_collections;
+    size_t promoted_bytes;
+    double minor_pause_ms;
+} lgc_stats;
+
+lgc_stats lgc_get_stats(void);
+char* lgc_name(void);
+
+#ifdef CLISP_GC
+
+void* lgc_alloc(size_t size, int kind);
+void lgc_safepoint(struct lenv* e, struct lval** v);
+
+enum {
+    LGC_LVAL,
+    LGC_LENV,
+    LGC_CELLS
+};
+
+#define LGC_ROOT(v) lgc_root(&(v))
+#define LGC_ROOT_ENV(e) lgc_root_env(e)
+#define LGC_UNROOT(count) lgc_unroot(count)
+
+#else
+
+#define LGC_ROOT(v)
+#define LGC_ROOT_ENV(e)
+#define LGC_UNROOT(count)
+
+#endif
+
+#ifdef CLISP_GC_NURSERY
+
+// call after storing value into obj (an lval or lenv, per kind)
+void lgc_barrier(void* obj, int kind, struct lval* value);
+
+#define LGC_BARRIER(obj, kind, value) lgc_barrier(obj, kind, value)
+
+#else
+
+#define LGC_BARRIER(obj, kind, value)
+
+#endif
+
+#endif
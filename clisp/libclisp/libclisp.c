@@ -1,3 +1,4 @@
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -10,45 +11,32 @@
         return err;                               \
     }
 
-#define LASSERT_TYPE(func, args, index, expect)                 \
-    LASSERT(args, args->cell[index]->type == expect,            \
-        "Function '%s' passed incorrect type for argument %i. " \
-        "Got %s, Expected %s.",                                 \
-        func, index, ltype_name(args->cell[index]->type), ltype_name(expect))
-
-#define LASSERT_NUM(func, args, num)                           \
-    LASSERT(args, args->count == num,                          \
-        "Function '%s' passed incorrect number of arguments. " \
-        "Got %i, Expected %i.",                                \
-        func, args->count, num)
-
 #define LASSERT_NOT_EMPTY(func, args, index)     \
     LASSERT(args, args->cell[index]->count != 0, \
         "Function '%s' passed {} for argument %i.", func, index);
 
 static lval* builtin_load(lenv* e, lval* a)
 {
-    LASSERT_NUM("load", a, 1);
-    LASSERT_TYPE("load", a, 0, LVAL_STR);
-
     // parse file given by string name
     mpc_result_t r;
-    if (mpc_parse_contents(a->cell[0]->str, e->lispy, &r)) {
+    if (mpc_parse_contents(lval_to_str(a->cell[0]), e->lispy, &r)) {
         // read contents
         lval* expr = lval_read(r.output);
         mpc_ast_delete(r.output);
 
         // evaluate each expression
+        LGC_ROOT(expr);
         while (expr->count) {
             lval* x = lval_pop(expr, 0);
-            x = lval_eval(e, x);
+            x = lvm_eval(e, x);
 
             // if we got an error, print it
-            if (x->type == LVAL_ERR) {
+            if (lval_type(x) == LVAL_ERR) {
                 lval_println(x);
             }
             lval_del(x);
         }
+        LGC_UNROOT(1);
 
         lval_del(expr);
         lval_del(a);
@@ -67,37 +55,21 @@ static lval* builtin_load(lenv* e, lval* a)
     }
 }
 
-static lval* builtin_head(lenv* e, lval* a)
+lval* builtin_head(lenv* e, lval* a)
 {
-    // error check
-    LASSERT(a, a->count == 1, "Function 'head' passed too many arguments. Got %i, epxected %i", a->count, 1);
-    LASSERT(a, a->cell[0]->type == LVAL_QEXPR, "Function 'head' passed inccorect type for argument 0. Got %s, Expected %s", ltype_name(a->cell[0]->type), ltype_name(LVAL_QEXPR));
     LASSERT(a, a->cell[0]->count != 0, "Function 'head' received empty qexpr");
 
-    // we're good, take first arg
-    lval* v = lval_take(a, 0);
-
-    // delete elements which aren't head
-    while (v->count > 1) {
-        lval_del(lval_pop(v, 1));
-    }
-    return v;
+    // we're good, take first arg and view its first element
+    return lval_slice(lval_take(a, 0), 0, 1);
 }
 
-static lval* builtin_tail(lenv* e, lval* a)
+lval* builtin_tail(lenv* e, lval* a)
 {
-    // error check
-    LASSERT(a, a->count == 1, "Function 'tail' passed too many arguments. Got %i, epxected %i", a->count, 1);
-    LASSERT(a, a->cell[0]->type == LVAL_QEXPR, "Function 'tail' passed inccorect type for argument 0. Got %s, Expected %s", ltype_name(a->cell[0]->type), ltype_name(LVAL_QEXPR));
     LASSERT(a, a->cell[0]->count != 0, "Function 'tail' received empty qexpr");
 
-    // take first arg
+    // take first arg and view everything after its first element
     lval* v = lval_take(a, 0);
-
-    // delete frist arg, and return rest
-    lval_del(lval_pop(v, 0));
-
-    return v;
+    return lval_slice(v, 1, v->count - 1);
 }
 
 static lval* builtin_list(lenv* e, lval* a)
@@ -108,19 +80,13 @@ static lval* builtin_list(lenv* e, lval* a)
 
 static lval* builtin_eval(lenv* e, lval* a)
 {
-    LASSERT(a, a->count == 1, "Function 'eval' passed too many arguments. Got %i, expected %i", a->count, 1);
-    LASSERT(a, a->cell[0]->type == LVAL_QEXPR, "Function 'eval' passed incorrect type for argument 0. Got %s expected %s", ltype_name(a->cell[0]->type), ltype_name(LVAL_QEXPR));
-
-    lval* x = lval_take(a, 0);
+    lval* x = lval_unshare(lval_take(a, 0));
     x->type = LVAL_SEXPR;
-    return lval_eval(e, x);
+    return lval_tail(x);
 }
 
 static lval* builtin_join(lenv* e, lval* a)
 {
-    for (int i = 0; i < a->count; i++) {
-        LASSERT(a, a->cell[i]->type == LVAL_QEXPR, "Incorrect argument type passed to 'join'. Argument %i was type %s, expected %s", i, ltype_name(a->cell[i]->type), ltype_name(LVAL_QEXPR));
-    }
     lval* x = lval_pop(a, 0);
     while (a->count) {
         x = lval_join(x, lval_pop(a, 0));
@@ -129,120 +95,81 @@ static lval* builtin_join(lenv* e, lval* a)
     return x;
 }
 
-static lval* builtin_op(lenv* e, lval* a, char* op)
-{
-    // ensure all args are numeric
-    for (int i = 0; i < a->count; i++) {
-        if (a->cell[i]->type != LVAL_NUM) {
-            lval* err = lval_err("Numeric operator %s passed incorrect type for argument %i. Got %s, expected: %s", op, i, ltype_name(a->cell[i]->type), ltype_name(LVAL_NUM));
-            lval_del(a);
-            return err;
-        }
-    }
-
-    // pop the first element
-    lval* x = lval_pop(a, 0);
-
-    // if no arguments and op is sub, perform unary negation
-    if ((strcmp(op, "-") == 0) && a->count == 0) {
-        x->num = -x->num;
+// An arithmetic builtin folds x = x OP y over its arguments, which its
+// signature has made sure are one or more numbers. Numbers are
+// immediates, so the loop reads raw values without popping or
+// allocating per operand, and two fixnums, the usual case, skip it
+// altogether. negate makes a single argument negative, div reports a
+// zero divisor.
+#define LBUILTIN_ARITH(name, OP, negate, div)                                         \
+    lval* name(lenv* e, lval* a)                                                      \
+    {                                                                                 \
+        if (a->count == 2 && lval_is_fixnum(a->cell[0]) && lval_is_fixnum(a->cell[1]) \
+            && !(div && lval_to_num(a->cell[1]) == 0)) {                              \
+            long x = lval_to_num(a->cell[0]) OP lval_to_num(a->cell[1]);              \
+            lval_del(a);                                                              \
+            return lval_num(x);                                                       \
+        }                                                                             \
+                                                                                      \
+        long x = lval_to_num(a->cell[0]);                                             \
+        if (negate && a->count == 1) {                                                \
+            x = -x;                                                                   \
+        }                                                                             \
+        for (int i = 1; i < a->count; i++) {                                          \
+            long y = lval_to_num(a->cell[i]);                                         \
+            if (div && y == 0) {                                                      \
+                lval_del(a);                                                          \
+                return lval_err("Division by zero.");                                 \
+            }                                                                         \
+            x = x OP y;                                                               \
+        }                                                                             \
+        lval_del(a);                                                                  \
+        return lval_num(x);                                                           \
     }
 
-    // while elements remain
-    while (a->count > 0) {
-        lval* y = lval_pop(a, 0);
-        if (strcmp(op, "+") == 0) {
-            x->num += y->num;
-        }
-        if (strcmp(op, "-") == 0) {
-            x->num -= y->num;
-        }
-        if (strcmp(op, "%") == 0) {
-            x->num %= y->num;
-        }
-        if (strcmp(op, "*") == 0) {
-            x->num *= y->num;
-        }
-        if (strcmp(op, "/") == 0) {
-            if (y->num == 0) {
-                lval_del(x);
-                lval_del(y);
-                x = lval_err("Division by zero.");
-                break;
-            } else {
-                x->num /= y->num;
-            }
-        }
-        lval_del(y);
+LBUILTIN_ARITH(builtin_add, +, 0, 0)
+LBUILTIN_ARITH(builtin_sub, -, 1, 0)
+LBUILTIN_ARITH(builtin_mul, *, 0, 0)
+LBUILTIN_ARITH(builtin_div, /, 0, 1)
+LBUILTIN_ARITH(builtin_mod, %, 0, 1)
+
+// comparisons of two numbers
+#define LBUILTIN_ORD(name, OP)                                      \
+    lval* name(lenv* e, lval* a)                                    \
+    {                                                               \
+        int r = lval_to_num(a->cell[0]) OP lval_to_num(a->cell[1]); \
+        lval_del(a);                                                \
+        return lval_num(r);                                         \
     }
-    lval_del(a);
-    return x;
-}
-
-static lval* builtin_add(lenv* e, lval* a)
-{
-    return builtin_op(e, a, "+");
-}
-
-static lval* builtin_sub(lenv* e, lval* a)
-{
-    return builtin_op(e, a, "-");
-}
-
-static lval* builtin_mul(lenv* e, lval* a)
-{
-    return builtin_op(e, a, "*");
-}
-
-static lval* builtin_div(lenv* e, lval* a)
-{
-    return builtin_op(e, a, "/");
-}
-
-static lval* builtin_mod(lenv* e, lval* a)
-{
-    return builtin_op(e, a, "%");
-}
-
-static lval* builtin_ord(lenv* e, lval* a, char* op)
-{
-    LASSERT_NUM(op, a, 2);
-    LASSERT_TYPE(op, a, 0, LVAL_NUM);
-    LASSERT_TYPE(op, a, 1, LVAL_NUM);
 
-    int r;
-    if (strcmp(op, ">") == 0) {
-        r = (a->cell[0]->num > a->cell[1]->num);
-    }
-    if (strcmp(op, "<") == 0) {
-        r = (a->cell[0]->num < a->cell[1]->num);
-    }
-    if (strcmp(op, ">=") == 0) {
-        r = (a->cell[0]->num >= a->cell[1]->num);
-    }
-    if (strcmp(op, "<=") == 0) {
-        r = (a->cell[0]->num <= a->cell[1]->num);
-    }
-    lval_del(a);
-    return lval_num(r);
-}
+LBUILTIN_ORD(builtin_gt, >)
+LBUILTIN_ORD(builtin_lt, <)
+LBUILTIN_ORD(builtin_ge, >=)
+LBUILTIN_ORD(builtin_le, <=)
 
-static int lval_eq(lval* x, lval* y)
+int lval_eq(lval* x, lval* y)
 {
     // different types are always unequal
-    if (x->type != y->type) {
+    if (lval_type(x) != lval_type(y)) {
         return 0;
     }
 
-    switch (x->type) {
+    switch (lval_type(x)) {
     case LVAL_NUM:
-        return (x->num == y->num);
+        return (lval_to_num(x) == lval_to_num(y));
     case LVAL_ERR:
         return (strcmp(x->err, y->err) == 0);
     case LVAL_SYM:
-        return (strcmp(x->sym, y->sym) == 0);
+        return x->sym == y->sym;
     case LVAL_STR:
-        return (strcmp(x->str, y->str) == 0);
+        // shared or unequal texts are settled without reading them
+        if (x->len != y->len || x->hash != y->hash) {
+            return 0;
+        }
+        if (x->len >= LVAL_STR_INLINE && x->text == y->text) {
+            return 1;
+        }
+        return memcmp(lval_to_str(x), lval_to_str(y), x->len) == 0;
 
     case LVAL_FUN:
         if (x->builtin || y->builtin) {
@@ -266,80 +193,128 @@ static int lval_eq(lval* x, lval* y)
     return 0;
 }
 
-static lval* builtin_cmp(lenv* e, lval* a, char* op)
-{
-    LASSERT_NUM(op, a, 2);
-    int r;
-    if (strcmp(op, "==") == 0) {
-        r = lval_eq(a->cell[0], a->cell[1]);
-    } else if (strcmp(op, "!=") == 0) {
-        r = !lval_eq(a->cell[0], a->cell[1]);
+// equality of any two values, negated for !=
+#define LBUILTIN_CMP(name, negate)               \
+    lval* name(lenv* e, lval* a)                 \
+    {                                            \
+        int r = lval_eq(a->cell[0], a->cell[1]); \
+        lval_del(a);                             \
+        return lval_num(negate ? !r : r);        \
     }
-    lval_del(a);
-    return lval_num(r);
-}
-
-static lval* builtin_if(lenv* e, lval* a)
-{
-    // expect 3 args - the condition, and the true path and the else path
-    LASSERT_NUM("if", a, 3);
-    LASSERT_TYPE("if", a, 0, LVAL_NUM);
-    LASSERT_TYPE("if", a, 1, LVAL_QEXPR);
-    LASSERT_TYPE("if", a, 2, LVAL_QEXPR);
 
-    // mark both branches as evaluable
-    a->cell[1]->type = LVAL_SEXPR;
-    a->cell[2]->type = LVAL_SEXPR;
+LBUILTIN_CMP(builtin_eq, 0)
+LBUILTIN_CMP(builtin_ne, 1)
 
-    lval* x;
-    if (a->cell[0]->num) {
-        x = lval_eval(e, lval_pop(a, 1));
-    } else {
-        x = lval_eval(e, lval_pop(a, 2));
-    }
+lval* builtin_if(lenv* e, lval* a)
+{
+    // the condition, and the true path and the else path
+    // the branches may be shared with a function body, so only the
+    // chosen one is made private before marking it evaluable
+    lval* x = lval_unshare(lval_pop(a, lval_to_num(a->cell[0]) ? 1 : 2));
+    x->type = LVAL_SEXPR;
     lval_del(a);
-    return x;
+    return lval_tail(x);
 }
 
-lval* builtin_eq(lenv* e, lval* a)
+// the last of its arguments. lval_eval leaves that one to evaluate in
+// tail position, see lval_form.
+lval* builtin_do(lenv* e, lval* a)
 {
-    return builtin_cmp(e, a, "==");
+    return lval_take(a, a->count - 1);
 }
 
-lval* builtin_ne(lenv* e, lval* a)
-{
-    return builtin_cmp(e, a, "!=");
-}
+// The clauses of select and case are Q-expressions of two expressions,
+// evaluated in the frame they are called from. The caller's variables
+// are then seen under lexical scope as well as under dynamic scope.
+#define LASSERT_CLAUSES(func, args, from)                                       \
+    for (int i = from; i < args->count; i++) {                                  \
+        LASSERT(args, args->cell[i]->count == 2,                                \
+            "Function '%s' passed a clause of %i expressions for argument %i. " \
+            "Expected 2.",                                                      \
+            func, args->cell[i]->count, i);                                     \
+    }
 
-static lval* builtin_gt(lenv* e, lval* a)
+// the expression of clause i of a, taking a, left to evaluate in tail
+// position
+static lval* lval_clause(lval* a, int i)
 {
-    return builtin_ord(e, a, ">");
+    lval* x = lval_retain(a->cell[i]->cell[1]);
+    lval_del(a);
+    return lval_tail(x);
 }
 
-static lval* builtin_lt(lenv* e, lval* a)
+// the value of the first clause whose condition isn't 0
+static lval* builtin_select(lenv* e, lval* a)
 {
-    return builtin_ord(e, a, "<");
-}
+    LASSERT_CLAUSES("select", a, 0);
 
-static lval* builtin_ge(lenv* e, lval* a)
-{
-    return builtin_ord(e, a, ">=");
+    lval* x = NULL;
+    LGC_ROOT(a);
+    int i = 0;
+    for (; i < a->count; i++) {
+        x = lval_eval(e, lval_retain(a->cell[i]->cell[0]));
+        if (lval_type(x) != LVAL_NUM || lval_to_num(x)) {
+            break;
+        }
+    }
+    LGC_UNROOT(1);
+
+    // with no clause left the lisp select this replaces evaluated
+    // (select), which is select itself rather than an error
+    if (i == a->count) {
+        lval_del(a);
+        return lval_tail(lval_add(lval_sexpr(), lval_sym("select")));
+    }
+    if (lval_type(x) == LVAL_NUM) {
+        return lval_clause(a, i);
+    }
+    if (lval_type(x) != LVAL_ERR) {
+        lval* err = lval_err("Function 'select' passed a condition of type %s in argument %i. "
+                             "Expected %s.",
+            ltype_name(lval_type(x)), i, ltype_name(LVAL_NUM));
+        lval_del(x);
+        x = err;
+    }
+    lval_del(a);
+    return x;
 }
 
-static lval* builtin_le(lenv* e, lval* a)
+// the value of the first clause whose key equals the first argument
+static lval* builtin_case(lenv* e, lval* a)
 {
-    return builtin_ord(e, a, "<=");
+    LASSERT_CLAUSES("case", a, 1);
+
+    lval* key = NULL;
+    LGC_ROOT(a);
+    int i = 1;
+    for (; i < a->count; i++) {
+        key = lval_eval(e, lval_retain(a->cell[i]->cell[0]));
+        if (lval_type(key) == LVAL_ERR || lval_eq(a->cell[0], key)) {
+            break;
+        }
+        lval_del(key);
+    }
+    LGC_UNROOT(1);
+
+    if (i == a->count) {
+        lval_del(a);
+        return lval_err("No case found");
+    }
+    if (lval_type(key) == LVAL_ERR) {
+        lval_del(a);
+        return key;
+    }
+    lval_del(key);
+    return lval_clause(a, i);
 }
 
 static lval* builtin_var(lenv* e, lval* a, char* func)
 {
-    LASSERT_TYPE(func, a, 0, LVAL_QEXPR);
-
     lval* syms = a->cell[0];
     for (int i = 0; i < syms->count; i++) {
-        LASSERT(a, (syms->cell[i]->type == LVAL_SYM),
+        LASSERT(a, (lval_type(syms->cell[i]) == LVAL_SYM),
             "Function '%s' cannot define non-symbol. Got %s expected %s",
-            func, ltype_name(syms->cell[i]->type), ltype_name(LVAL_SYM));
+            func, ltype_name(lval_type(syms->cell[i])), ltype_name(LVAL_SYM));
     }
 
     LASSERT(a, (syms->count == a->count - 1),
@@ -369,25 +344,32 @@ static lval* builtin_put(lenv* e, lval* a)
     return builtin_var(e, a, "=");
 }
 
-static lval* builtin_lambda(lenv* e, lval* a)
-{
-    // requires two args, both QEXPR
-    LASSERT_NUM("\\", a, 2);
-    LASSERT_TYPE("\\", a, 0, LVAL_QEXPR);
-    LASSERT_TYPE("\\", a, 1, LVAL_QEXPR);
+static lval* lval_fold(lenv* e, lval* f);
 
+lval* builtin_lambda(lenv* e, lval* a)
+{
     // first QEXPR may only contain symbols
     for (int i = 0; i < a->cell[0]->count; i++) {
-        LASSERT(a, (a->cell[0]->cell[i]->type == LVAL_SYM),
+        LASSERT(a, (lval_type(a->cell[0]->cell[i]) == LVAL_SYM),
             "Cannot define non-symbol. Got %s expected %s",
-            ltype_name(a->cell[0]->cell[i]->type), ltype_name(LVAL_SYM));
+            ltype_name(lval_type(a->cell[0]->cell[i])), ltype_name(LVAL_SYM));
     }
 
     // pop first two args and pass them to lval_lambda
     lval* formals = lval_pop(a, 0);
     lval* body = lval_pop(a, 0);
     lval_del(a);
-    return lval_lambda(formals, body);
+    return lval_fold(e, lval_lambda(e, formals, body));
+}
+
+// evaluate the body in a new scope, as the call of a lambda without
+// formals. It is made once, so isn't folded.
+static lval* builtin_let(lenv* e, lval* a)
+{
+    lval* f = lval_lambda(e, lval_qexpr(), lval_take(a, 0));
+    lval* x = lval_tail_call(e, f, lval_sexpr());
+    lval_del(f);
+    return x;
 }
 
 static lval* builtin_print(lenv* e, lval* a)
@@ -403,21 +385,32 @@ static lval* builtin_print(lenv* e, lval* a)
 
 static lval* builtin_error(lenv* e, lval* a)
 {
-    LASSERT_NUM("error", a, 1);
-    LASSERT_TYPE("error", a, 0, LVAL_STR);
-
-    lval* err = lval_err(a->cell[0]->str);
+    lval* err = lval_err(lval_to_str(a->cell[0]));
     lval_del(a);
     return err;
 }
 
 static void lval_print_str(lval* v)
 {
-    char* escaped = malloc(strlen(v->str) + 1);
-    strcpy(escaped, v->str);
-    escaped = mpcf_escape(escaped);
-    printf("\"%s\"", escaped);
-    free(escaped);
+    // write runs of plain characters straight out, escaping the rest as
+    // mpcf_escape would
+    static const char escapes[] = "\a\b\f\n\r\t\v\\\'\"";
+    static const char codes[] = "abfnrtv\\'\"";
+
+    char* s = lval_to_str(v);
+    int run = 0;
+    putchar('"');
+    for (int i = 0; i < v->len; i++) {
+        char* escape = strchr(escapes, s[i]);
+        if (escape) {
+            fwrite(s + run, 1, i - run, stdout);
+            putchar('\\');
+            putchar(codes[escape - escapes]);
+            run = i + 1;
+        }
+    }
+    fwrite(s + run, 1, v->len - run, stdout);
+    putchar('"');
 }
 
 static void lval_expr_print(lval* v, char open, char close)
@@ -449,20 +442,39 @@ static lval* lval_read_str(mpc_ast_t* t)
 
 ///////////////////////////////////////////////////////////////////////
 
-static lval* lval_new()
-{
-    lval* v = malloc(sizeof(lval));
-    v->type = 0;
-    v->num = 0;
-    v->err = NULL;
-    v->sym = NULL;
-    v->str = NULL;
-    v->builtin = NULL;
-    v->env = NULL;
-    v->formals = NULL;
-    v->body = NULL;
-    v->count = 0;
-    v->cell = NULL;
+size_t lval_size(int type)
+{
+    switch (type) {
+    case LVAL_NUM:
+        return offsetof(lval, num) + sizeof(long);
+    case LVAL_ERR:
+        return offsetof(lval, err) + sizeof(char*);
+    case LVAL_SYM:
+        return offsetof(lval, version) + sizeof(unsigned long);
+    case LVAL_STR:
+        return offsetof(lval, small) + LVAL_STR_INLINE;
+    case LVAL_FUN:
+        return offsetof(lval, fold_version) + sizeof(unsigned long);
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+        return offsetof(lval, buf) + sizeof(lcells*);
+    default:
+        return sizeof(lval);
+    }
+}
+
+static lval* lval_new(int type)
+{
+    // only allocate (and initialize) the payload for this type
+    size_t size = lval_size(type);
+#ifdef CLISP_GC
+    lval* v = lgc_alloc(size, LGC_LVAL);
+#else
+    lval* v = lalloc(size);
+#endif
+    memset(v, 0, size);
+    v->type = type;
+    v->refs = 1;
     return v;
 }
 
@@ -494,19 +506,312 @@ lval* lval_load(lenv* e, char* file)
     return builtin_load(e, args);
 }
 
+static lcells* lcells_new(int capacity)
+{
+#ifdef CLISP_GC
+    lcells* c = lgc_alloc(sizeof(lcells), LGC_CELLS);
+#else
+    lcells* c = lalloc(sizeof(lcells));
+#endif
+    c->refs = 1;
+    c->lo = 0;
+    c->hi = 0;
+    c->cap = capacity;
+    c->items = malloc(sizeof(lval*) * capacity);
+    return c;
+}
+
+static lcells* lcells_retain(lcells* c)
+{
+#ifdef CLISP_GC
+    c->refs = 2;
+#else
+    c->refs++;
+#endif
+    return c;
+}
+
+static void lcells_release(lcells* c)
+{
+#ifdef CLISP_GC
+    return;
+#endif
+    if (--c->refs > 0) {
+        return;
+    }
+    for (int i = c->lo; i < c->hi; i++) {
+        lval_del(c->items[i]);
+    }
+    free(c->items);
+    lalloc_free(c, sizeof(lcells));
+}
+
+// v has sole use of its buffer: drop the cells it doesn't view
+static void lval_trim(lval* v)
+{
+    lcells* c = v->buf;
+    int lo = v->cell - c->items;
+    for (int i = c->lo; i < lo; i++) {
+        lval_del(c->items[i]);
+    }
+    for (int i = lo + v->count; i < c->hi; i++) {
+        lval_del(c->items[i]);
+    }
+    c->lo = lo;
+    c->hi = lo + v->count;
+}
+
+// give v a buffer holding exactly the cells it views, copying them out
+// of a shared buffer if need be
+static void lval_detach(lval* v)
+{
+    lcells* c = v->buf;
+    if (c->refs == 1) {
+        lval_trim(v);
+        return;
+    }
+
+    lcells* n = lcells_new(v->count);
+    for (int i = 0; i < v->count; i++) {
+        n->items[i] = lval_retain(v->cell[i]);
+    }
+    n->hi = v->count;
+    lcells_release(c);
+    v->buf = n;
+    v->cell = n->items;
+}
+
+// make room in v's private buffer for front more cells before its
+// first and back more after its last. Growth is geometric, with the
+// spare room placed on the side that asked for it.
+static void lval_reserve(lval* v, int front, int back)
+{
+    lcells* c = v->buf;
+    if (!c) {
+        c = v->buf = lcells_new(back > 4 ? back : 4);
+    }
+    if (c->lo >= front && c->cap - c->hi >= back) {
+        v->cell = c->items + c->lo;
+        return;
+    }
+
+    int count = c->hi - c->lo;
+    int cap = 2 * (count + front + back);
+    int spare = cap - count - front - back;
+    int lo = front ? front + spare : 0;
+
+    lval** items = malloc(sizeof(lval*) * cap);
+    memcpy(items + lo, c->items + c->lo, sizeof(lval*) * count);
+    free(c->items);
+
+    c->items = items;
+    c->cap = cap;
+    c->lo = lo;
+    c->hi = lo + count;
+    v->cell = items + lo;
+}
+
+// close the gap left by count cells of v from start
+static void lval_close(lval* v, int start, int count)
+{
+    if (count == 0) {
+        return;
+    }
+
+    if (start == 0) {
+        // removing from the front just narrows the view
+        v->cell += count;
+        v->buf->lo += count;
+    } else {
+        memmove(&v->cell[start], &v->cell[start + count], sizeof(lval*) * (v->count - start - count));
+        v->buf->hi -= count;
+    }
+    v->count -= count;
+}
+
+// delete the cells of v from count onwards
+static void lval_truncate(lval* v, int count)
+{
+    for (int i = count; i < v->count; i++) {
+        lval_del(v->cell[i]);
+    }
+    if (v->buf) {
+        v->buf->hi -= v->count - count;
+    }
+    v->count = count;
+}
+
+lval* lval_remove(lval* v, int start, int count)
+{
+    for (int i = start; i < start + count; i++) {
+        lval_del(v->cell[i]);
+    }
+    lval_close(v, start, count);
+    return v;
+}
+
+// consume list v, returning a list of count of its cells from start.
+// Shares v's buffer rather than copying when v can't be reused.
+lval* lval_slice(lval* v, int start, int count)
+{
+    if (v->refs == 1 && v->buf && v->buf->refs == 1) {
+        // sole owner, cut the buffer down to the slice in place
+        lval_trim(v);
+        lval_truncate(v, start + count);
+        return lval_remove(v, 0, start);
+    }
+
+    if (v->refs > 1) {
+        lval* x = lval_new(v->type);
+        x->count = v->count;
+        x->cell = v->cell;
+        x->buf = v->buf ? lcells_retain(v->buf) : NULL;
+        lval_del(v);
+        v = x;
+    }
+
+    v->cell += start;
+    v->count = count;
+    return v;
+}
+
+// move the cells of list from into dst, consuming from. Cells are taken
+// over outright when from is the sole owner of its buffer.
+static void lval_splice(lval** dst, lval* from)
+{
+    memcpy(dst, from->cell, sizeof(lval*) * from->count);
+    if (from->buf && from->refs == 1 && from->buf->refs == 1) {
+        lval_trim(from);
+        from->buf->hi = from->buf->lo;
+        from->count = 0;
+    } else {
+        for (int i = 0; i < from->count; i++) {
+            lval_retain(dst[i]);
+        }
+    }
+    lval_del(from);
+}
+
+// make x a string with the same text as v, sharing it if it's long
+static void lval_str_share(lval* x, lval* v)
+{
+    x->len = v->len;
+    x->hash = v->hash;
+    if (v->len < LVAL_STR_INLINE) {
+        memcpy(x->small, v->small, v->len + 1);
+    } else {
+        x->text = v->text;
+        x->text->refs++;
+    }
+}
+
+void lval_str_release(lval* v)
+{
+    if (v->len >= LVAL_STR_INLINE && --v->text->refs == 0) {
+        free(v->text);
+    }
+}
+
 lval* lval_copy(lval* v)
 {
-    lval* x = lval_new();
-    x->type = v->type;
+    if (lval_is_fixnum(v)) {
+        return v;
+    }
+
+    lval* x = lval_new(v->type);
     switch (v->type) {
     case LVAL_FUN:
         if (v->builtin) {
             x->builtin = v->builtin;
+            x->sig = v->sig;
         } else {
-            x->builtin = NULL;
             x->env = lenv_copy(v->env);
             x->formals = lval_copy(v->formals);
             x->body = lval_copy(v->body);
+            x->code = lcode_retain(v->code);
+            x->folded = v->folded ? lval_retain(v->folded) : NULL;
+            x->fold_version = v->fold_version;
+        }
+        break;
+    case LVAL_NUM:
+        x->num = v->num;
+        break;
+
+    case LVAL_ERR:
+        x->err = malloc(strlen(v->err) + 1);
+        strcpy(x->err, v->err);
+        break;
+
+    case LVAL_SYM:
+        x->sym = v->sym;
+        x->slot = v->slot;
+        x->global = v->global;
+        x->version = v->version;
+        break;
+
+    case LVAL_STR:
+        lval_str_share(x, v);
+        break;
+
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+        if (v->count) {
+            x->buf = lcells_new(v->count);
+            for (int i = 0; i < v->count; i++) {
+                x->buf->items[i] = lval_copy(v->cell[i]);
+            }
+            x->buf->hi = v->count;
+            x->cell = x->buf->items;
+            x->count = v->count;
+        }
+        break;
+    }
+
+    return x;
+}
+
+lval* lval_retain(lval* v)
+{
+    if (!lval_is_fixnum(v)) {
+#ifdef CLISP_GC
+        // lifetime belongs to the collector, refs only records sharing
+        v->refs = 2;
+#else
+        v->refs++;
+#endif
+    }
+    return v;
+}
+
+lval* lval_unshare(lval* v)
+{
+    if (lval_is_fixnum(v)) {
+        return v;
+    }
+
+    if (v->refs == 1) {
+        // lists also need their buffer to themselves
+        if ((v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) && v->buf) {
+            lval_detach(v);
+        }
+        return v;
+    }
+
+    // shallow copy: children are shared with the original
+    lval* x = lval_new(v->type);
+    switch (v->type) {
+    case LVAL_FUN:
+        if (v->builtin) {
+            x->builtin = v->builtin;
+            x->sig = v->sig;
+        } else {
+            // the env is written to when binding arguments
+            x->env = lenv_copy(v->env);
+            x->formals = lval_retain(v->formals);
+            x->body = lval_retain(v->body);
+            x->code = lcode_retain(v->code);
+            x->folded = v->folded ? lval_retain(v->folded) : NULL;
+            x->fold_version = v->fold_version;
         }
         break;
     case LVAL_NUM:
@@ -519,95 +824,625 @@ lval* lval_copy(lval* v)
         break;
 
     case LVAL_SYM:
-        x->sym = malloc(strlen(v->sym) + 1);
-        strcpy(x->sym, v->sym);
+        x->sym = v->sym;
+        x->slot = v->slot;
+        x->global = v->global;
+        x->version = v->version;
         break;
 
     case LVAL_STR:
-        x->str = malloc(strlen(v->str) + 1);
-        strcpy(x->str, v->str);
+        lval_str_share(x, v);
         break;
 
     case LVAL_SEXPR:
     case LVAL_QEXPR:
         x->count = v->count;
-        x->cell = malloc(sizeof(lval*) * x->count);
-        for (int i = 0; i < x->count; i++) {
-            x->cell[i] = lval_copy(v->cell[i]);
+        x->cell = v->cell;
+        if (v->buf) {
+            x->buf = lcells_retain(v->buf);
+            lval_detach(x);
         }
         break;
     }
 
+    // drop the caller's reference to the shared original
+    lval_del(v);
     return x;
 }
 
 lval* lval_num(long x)
 {
-    lval* v = lval_new();
-    v->type = LVAL_NUM;
+    if (x >= LVAL_FIXNUM_MIN && x <= LVAL_FIXNUM_MAX) {
+        return (lval*)(((uintptr_t)x << 1) | 1);
+    }
+
+    // only numbers which need the full 64 bits are boxed
+    lval* v = lval_new(LVAL_NUM);
     v->num = x;
     return v;
 }
 
 lval* lval_sym(char* s)
 {
-    lval* v = lval_new();
-    v->type = LVAL_SYM;
-    v->sym = malloc(strlen(s) + 1);
-    strcpy(v->sym, s);
+    lval* v = lval_new(LVAL_SYM);
+    v->sym = lsym_intern(s);
+    v->slot = -1;
+    v->global = -1;
+    v->version = 0;
     return v;
 }
 
 lval* lval_str(char* s)
 {
-    lval* v = lval_new();
-    v->type = LVAL_STR;
-    v->str = malloc(strlen(s) + 1);
-    strcpy(v->str, s);
+    lval* v = lval_new(LVAL_STR);
+    v->len = strlen(s);
+    v->hash = lsym_hash(s);
+    if (v->len < LVAL_STR_INLINE) {
+        memcpy(v->small, s, v->len + 1);
+    } else {
+        v->text = malloc(sizeof(lstr) + v->len + 1);
+        v->text->refs = 1;
+        memcpy(v->text->chars, s, v->len + 1);
+    }
     return v;
 }
 
 lval* lval_sexpr()
 {
-    lval* v = lval_new();
-    v->type = LVAL_SEXPR;
-    v->count = 0;
-    v->cell = NULL;
+    lval* v = lval_new(LVAL_SEXPR);
     return v;
 }
 
 lval* lval_qexpr()
 {
-    lval* v = lval_new();
-    v->type = LVAL_QEXPR;
-    v->count = 0;
-    v->cell = NULL;
+    lval* v = lval_new(LVAL_QEXPR);
     return v;
 }
 
-lval* lval_fun(lbuiltin fun)
+lval* lval_fun(const lsig* sig)
 {
-    lval* v = lval_new();
-    v->type = LVAL_FUN;
-    v->builtin = fun;
+    lval* v = lval_new(LVAL_FUN);
+    v->builtin = sig->builtin;
+    v->sig = sig;
     return v;
 }
 
-lval* lval_lambda(lval* formals, lval* body)
+static char* lsym_variadic()
 {
-    lval* v = lval_new();
-    v->type = LVAL_FUN;
-
-    v->env = lenv_new(NULL);
-    v->formals = formals;
-    v->body = body;
-    return v;
+    static char* sym = NULL;
+    if (!sym) {
+        sym = lsym_intern("&");
+    }
+    return sym;
 }
 
-lval* lval_err(char* fmt, ...)
+static inline int lenv_find(lenv* e, char* sym);
+static void lenv_bind(lenv* e, lval* k, lval* v);
+
+// point each use of a parameter in body at the slot the parameter is
+// bound to in the lambda's frame, which is its position in formals
+// once '&' is skipped, after any captured variables. Under dynamic
+// scope frames are only known at run time, so this is a hint that
+// lenv_get checks.
+static void lval_resolve(lenv* closure, lval* formals, lval* body)
+{
+    for (int i = 0; i < body->count; i++) {
+        lval* x = body->cell[i];
+        switch (lval_type(x)) {
+        case LVAL_SYM:
+            x->slot = lenv_find(closure, x->sym);
+            if (x->slot >= 0) {
+                break;
+            }
+            for (int j = 0, slot = closure->count; j < formals->count; j++) {
+                if (formals->cell[j]->sym == lsym_variadic()) {
+                    continue;
+                }
+                if (formals->cell[j]->sym == x->sym) {
+                    x->slot = slot;
+                    break;
+                }
+                slot++;
+            }
+            break;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            lval_resolve(closure, formals, x);
+            break;
+        }
+    }
+}
+
+#ifdef CLISP_LEXICAL_SCOPE
+static int lval_is_formal(lval* formals, char* sym)
+{
+    for (int i = 0; i < formals->count; i++) {
+        if (formals->cell[i]->sym == sym) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// copy into closure the variables body uses that are bound in the frame
+// e, but aren't parameters. Nothing can rebind them, so a copy of the
+// value is as good as a reference to the frame.
+static void lval_capture(lenv* closure, lenv* e, lval* formals, lval* body)
+{
+    for (int i = 0; i < body->count; i++) {
+        lval* x = body->cell[i];
+        switch (lval_type(x)) {
+        case LVAL_SYM: {
+            if (!lsym_is_local(x->sym) || lval_is_formal(formals, x->sym)
+                || lenv_find(closure, x->sym) >= 0) {
+                break;
+            }
+            int j = lenv_find(e, x->sym);
+            if (j >= 0) {
+                lenv_bind(closure, x, e->vals[j]);
+            }
+            break;
+        }
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            lval_capture(closure, e, formals, x);
+            break;
+        }
+    }
+}
+#endif
+
+// Lambda bodies made by \ are folded: where the body is evaluated as
+// code, a symbol which can only be bound globally and names a builtin or
+// a literal is replaced by its value, and a call of a pure builtin on
+// literals by its result. Small lambdas called there are inlined, see
+// lval_inline. The folded body is evaluated in place of the original.
+// The globals used, or found unbound, are marked LSYM_FOLDED, and
+// binding one moves fold_version on, so that bodies folded before are
+// folded again when next called. A body rebinding one while it runs
+// sees the change from its next call. The vm compiles the folded body,
+// and compiles it again once it has been folded again.
+#define LVAL_INLINE_DEPTH 4
+
+static int fold_enabled = 1;
+static unsigned long fold_version = 1;
+static int inline_budget = LVAL_INLINE_BUDGET;
+static int inline_depth; // of inlined calls being folded, up to LVAL_INLINE_DEPTH
+static lval_call_stats call_stats;
+
+void lval_fold_enable(int on)
+{
+    fold_enabled = on;
+}
+
+int lval_fold_enabled(void)
+{
+    return fold_enabled;
+}
+
+void lval_set_inline_budget(int budget)
+{
+    inline_budget = budget;
+}
+
+lval_call_stats lval_get_call_stats(void)
+{
+    return call_stats;
+}
+
+// sym is being bound in e, or made a parameter if e is NULL, which makes
+// bodies folded on its global value stale. Once a binding is replaced
+// it is marked as varying, so that this only happens a couple of times.
+static void lsym_rebind(lenv* e, char* sym)
+{
+    if ((lsym_marks(sym) & (LSYM_FOLDED | LSYM_VARIES)) != LSYM_FOLDED) {
+        return;
+    }
+    if (!e || e->parent || lenv_find(e, sym) >= 0) {
+        lsym_mark(sym, LSYM_VARIES);
+    }
+    fold_version++;
+}
+
+// whether v may be part of a literal: anything but an error or a user
+// function, which could hold a reference back to the body
+static int lval_is_data(lval* v)
+{
+    switch (lval_type(v)) {
+    case LVAL_ERR:
+        return 0;
+    case LVAL_FUN:
+        return v->builtin != NULL;
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+        for (int i = 0; i < v->count; i++) {
+            if (!lval_is_data(v->cell[i])) {
+                return 0;
+            }
+        }
+        return 1;
+    }
+    return 1;
+}
+
+// whether v evaluates to itself and can stand in a body for that value
+static int lval_is_literal(lval* v)
+{
+    int type = lval_type(v);
+    return type != LVAL_SYM && type != LVAL_SEXPR && lval_is_data(v);
+}
+
+static lval* lval_call_builtin(lenv* e, lval* f, lval* a);
+static lval* lval_fold_body(lenv* g, lval* body);
+static lval* lval_fold_expr(lenv* g, lval* x);
+static lval* lval_inline(lenv* g, lval* v);
+
+// fold the elements of the list v which are evaluated, returning v if
+// none change. The branches of an if are code, other Q-expressions data.
+static lval* lval_fold_list(lenv* g, lval* v)
+{
+    lval* x = NULL; // the folded copy, made at the first change
+    int branches = v->count == 4;
+    for (int i = 0; i < v->count; i++) {
+        lval* c = v->cell[i];
+        lval* y;
+        if (lval_type(c) == LVAL_QEXPR) {
+            y = branches && i >= 2 ? lval_fold_body(g, c) : lval_retain(c);
+        } else {
+            y = lval_fold_expr(g, c);
+        }
+        if (i == 0) {
+            branches = branches && lval_type(y) == LVAL_FUN && y->builtin == builtin_if;
+        }
+
+        if (!x && y != c) {
+            x = lval_new(v->type);
+            for (int j = 0; j < i; j++) {
+                lval_add(x, lval_retain(v->cell[j]));
+            }
+        }
+        if (x) {
+            lval_add(x, y);
+        } else {
+            lval_del(y);
+        }
+    }
+    if (x) {
+        lval_del(v);
+        return x;
+    }
+    return v;
+}
+
+// the result of the list v, taken, if it is a call of a pure builtin
+// on literals, else NULL
+static lval* lval_fold_call(lenv* g, lval* v)
+{
+    lval* f = v->count > 1 ? v->cell[0] : NULL;
+    if (!f || lval_type(f) != LVAL_FUN || !f->builtin || !f->sig->pure) {
+        return NULL;
+    }
+    for (int i = 1; i < v->count; i++) {
+        if (!lval_is_literal(v->cell[i])) {
+            return NULL;
+        }
+    }
+
+    // errors are left to be raised when the body runs
+    lval* a = lval_sexpr();
+    for (int i = 1; i < v->count; i++) {
+        lval_add(a, lval_retain(v->cell[i]));
+    }
+    lval* x = lval_call_builtin(g, f, a);
+    if (!lval_is_literal(x)) {
+        lval_del(x);
+        return NULL;
+    }
+    lval_del(v);
+    return x;
+}
+
+// A call of a lambda bound to a global is inlined when the lambda's
+// body is no bigger than inline_budget, doesn't call it by name and
+// evaluates the same with the arguments put in place of the formals.
+// Each argument which isn't a literal must then be evaluated exactly
+// once, in order, before anything which could fail or have effects, as
+// the call would have. Formals can't appear in data, nor anything else
+// local in the body at all. Under dynamic scope the frame dropped
+// could be seen by any function the body calls, through the formals it
+// binds, so it may only call builtins and lambdas bound to globals which
+// bind all those formals themselves, hiding them. Nothing can see it
+// under lexical scope, so it may call any function. Builtins which use
+// the frame they are called from, eval, let, select, case, load and =,
+// are never inlined over, which rules out first and second.
+typedef struct {
+    lenv* global;
+    lval* formals;
+    lval* call; // the argument for formals->cell[i] is call->cell[i + 1]
+    int next; // the formal whose argument is to be evaluated next
+} linline;
+
+// the index of sym in formals, or -1
+static int lval_formal(lval* formals, char* sym)
+{
+    for (int i = 0; i < formals->count; i++) {
+        if (formals->cell[i]->sym == sym) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// the first formal from i on passed an argument which isn't a literal,
+// or the count of formals if none is
+static int linline_next(linline* s, int i)
+{
+    while (i < s->formals->count && lval_is_literal(s->call->cell[i + 1])) {
+        i++;
+    }
+    return i;
+}
+
+// how many values make up x
+static int lval_nodes(lval* x)
+{
+    int n = 1;
+    int type = lval_type(x);
+    if (type == LVAL_SEXPR || type == LVAL_QEXPR) {
+        for (int i = 0; i < x->count; i++) {
+            n += lval_nodes(x->cell[i]);
+        }
+    }
+    return n;
+}
+
+// whether x uses the symbol sym anywhere
+static int lval_mentions(lval* x, char* sym)
+{
+    switch (lval_type(x)) {
+    case LVAL_SYM:
+        return x->sym == sym;
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+        for (int i = 0; i < x->count; i++) {
+            if (lval_mentions(x->cell[i], sym)) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+// whether the call x may be applied, once its arguments are evaluated
+static int linline_applies(linline* s, lval* x)
+{
+    lval* f = x->cell[0];
+    if (lval_type(f) == LVAL_FUN && f->builtin) {
+        return f->builtin != builtin_eval && f->builtin != builtin_let && f->builtin != builtin_select
+            && f->builtin != builtin_case && f->builtin != builtin_load && f->builtin != builtin_put;
+    }
+#ifdef CLISP_LEXICAL_SCOPE
+    return 1;
+#else
+    // a global lambda, fully applied, whose frame binds every formal.
+    // Rebinding it folds the body again, unless it varies.
+    if (lval_type(f) != LVAL_SYM || lsym_marks(f->sym) & (LSYM_LOCAL | LSYM_VARIES)) {
+        return 0;
+    }
+    int k = lenv_find(s->global, f->sym);
+    lval* g = k >= 0 ? s->global->vals[k] : NULL;
+    if (!g || lval_type(g) != LVAL_FUN || g->builtin || g->env->count
+        || g->formals->count != x->count - 1 || lval_formal(g->formals, lsym_variadic()) >= 0) {
+        return 0;
+    }
+    for (int i = 0; i < s->formals->count; i++) {
+        if (lval_formal(g->formals, s->formals->cell[i]->sym) < 0) {
+            return 0;
+        }
+    }
+    return 1;
+#endif
+}
+
+// check the folded body x of the lambda being inlined, code if code is
+// set and otherwise data, in the order it is evaluated
+static int linline_check(linline* s, lval* x, int code)
+{
+    switch (lval_type(x)) {
+    case LVAL_SYM: {
+        int i = lval_formal(s->formals, x->sym);
+        if (i < 0) {
+            // a global which is bound stays bound, so looking it up can't fail
+            return !lsym_is_local(x->sym)
+                && (!code || s->next == s->formals->count || lenv_find(s->global, x->sym) >= 0);
+        }
+        if (!code) {
+            return 0;
+        }
+        if (lval_is_literal(s->call->cell[i + 1])) {
+            return 1;
+        }
+        if (i != s->next) {
+            return 0;
+        }
+        s->next = linline_next(s, i + 1);
+        return 1;
+    }
+    case LVAL_SEXPR:
+    case LVAL_QEXPR: {
+        if (!code) {
+            for (int i = 0; i < x->count; i++) {
+                if (!linline_check(s, x->cell[i], 0)) {
+                    return 0;
+                }
+            }
+            return 1;
+        }
+
+        // the branches of an if are evaluated after it is applied
+        lval* f = x->count ? x->cell[0] : NULL;
+        int branches = x->count == 4 && lval_type(f) == LVAL_FUN && f->builtin == builtin_if ? 2 : 0;
+        for (int i = 0; i < x->count - branches; i++) {
+            if (!linline_check(s, x->cell[i], lval_type(x->cell[i]) != LVAL_QEXPR)) {
+                return 0;
+            }
+        }
+        if (x->count > 1 && (s->next != s->formals->count || !linline_applies(s, x))) {
+            return 0;
+        }
+        for (int i = x->count - branches; i < x->count; i++) {
+            if (!linline_check(s, x->cell[i], 1)) {
+                return 0;
+            }
+        }
+        return 1;
+    }
+    }
+    return 1;
+}
+
+// x with the arguments of the call put in place of the formals
+static lval* linline_args(linline* s, lval* x)
+{
+    switch (lval_type(x)) {
+    case LVAL_SYM: {
+        int i = lval_formal(s->formals, x->sym);
+        return lval_retain(i >= 0 ? s->call->cell[i + 1] : x);
+    }
+    case LVAL_SEXPR:
+    case LVAL_QEXPR: {
+        lval* y = lval_new(lval_type(x));
+        for (int i = 0; i < x->count; i++) {
+            lval_add(y, linline_args(s, x->cell[i]));
+        }
+        return y;
+    }
+    }
+    return lval_retain(x);
+}
+
+// the folded list v, a call, taken and replaced by the body of the
+// lambda it calls if that can be inlined
+static lval* lval_inline(lenv* g, lval* v)
 {
-    lval* v = lval_new();
-    v->type = LVAL_ERR;
+    if (inline_depth >= LVAL_INLINE_DEPTH || v->count < 2 || lval_type(v->cell[0]) != LVAL_SYM) {
+        return v;
+    }
+    char* sym = v->cell[0]->sym;
+    int i = lsym_marks(sym) & (LSYM_LOCAL | LSYM_VARIES) ? -1 : lenv_find(g, sym);
+    lval* f = i >= 0 ? g->vals[i] : NULL;
+    if (!f || lval_type(f) != LVAL_FUN || f->builtin || f->env->count
+        || f->formals->count != v->count - 1 || lval_nodes(f->body) > inline_budget
+        || lval_formal(f->formals, lsym_variadic()) >= 0 || lval_mentions(f->body, sym)) {
+        return v;
+    }
+
+    inline_depth++;
+    lval* body = lval_fold_body(g, f->body);
+    inline_depth--;
+
+    linline s = { g, f->formals, v, 0 };
+    s.next = linline_next(&s, 0);
+    lval* x = v;
+    if (lval_nodes(body) <= inline_budget && linline_check(&s, body, 1)
+        && s.next == f->formals->count) {
+        x = lval_new(v->type);
+        for (int i = 0; i < body->count; i++) {
+            lval_add(x, linline_args(&s, body->cell[i]));
+        }
+        call_stats.inlined++;
+        lval_del(v);
+    }
+    lval_del(body);
+    return x;
+}
+
+// fold the code x, returning a new reference to the result
+static lval* lval_fold_expr(lenv* g, lval* x)
+{
+    switch (lval_type(x)) {
+    case LVAL_SYM: {
+        if (lsym_marks(x->sym) & (LSYM_LOCAL | LSYM_VARIES)) {
+            break;
+        }
+        lsym_mark(x->sym, LSYM_FOLDED);
+        int i = lenv_find(g, x->sym);
+        if (i < 0 || !lval_is_literal(g->vals[i])) {
+            break;
+        }
+        return lval_retain(g->vals[i]);
+    }
+    case LVAL_SEXPR: {
+        lval* v = lval_inline(g, lval_fold_list(g, lval_retain(x)));
+        lval* r = lval_fold_call(g, v);
+        return r ? r : v;
+    }
+    }
+    return lval_retain(x);
+}
+
+// fold a body, a Q-expression evaluated as an S-expression. One folded
+// to a value becomes the list of just that value.
+static lval* lval_fold_body(lenv* g, lval* body)
+{
+    lval* v = lval_inline(g, lval_fold_list(g, lval_retain(body)));
+    lval* r = lval_fold_call(g, v);
+    return r ? lval_add(lval_qexpr(), r) : v;
+}
+
+// fold the body of the new lambda f, made in e
+static lval* lval_fold(lenv* e, lval* f)
+{
+    if (fold_enabled) {
+        f->folded = lval_fold_body(e->global, f->body);
+        f->fold_version = fold_version;
+    }
+    return f;
+}
+
+lval* lval_body(lenv* e, lval* f)
+{
+    if (!f->folded) {
+        return f->body;
+    }
+    if (f->fold_version != fold_version) {
+        lcode_release(f->code);
+        f->code = NULL;
+        lval_del(f->folded);
+        f->folded = lval_fold_body(e->global, f->body);
+        f->fold_version = fold_version;
+        LGC_BARRIER(f, LGC_LVAL, f->folded);
+    }
+    return f->folded;
+}
+
+lval* lval_lambda(lenv* e, lval* formals, lval* body)
+{
+    // parameters may now shadow globals
+    for (int i = 0; i < formals->count; i++) {
+        lsym_rebind(NULL, formals->cell[i]->sym);
+        lsym_mark_local(formals->cell[i]->sym);
+    }
+
+    lval* v = lval_new(LVAL_FUN);
+    v->env = lenv_new(NULL);
+    v->formals = formals;
+    v->body = body;
+
+    // a lambda made in a function's frame closes over the free variables
+    // it uses from there. The only other scope is the global env.
+#ifdef CLISP_LEXICAL_SCOPE
+    if (e->parent) {
+        lval_capture(v->env, e, formals, body);
+    }
+#endif
+    lval_resolve(v->env, formals, body);
+    return v;
+}
+
+lval* lval_err(char* fmt, ...)
+{
+    lval* v = lval_new(LVAL_ERR);
 
     va_list va;
     va_start(va, fmt);
@@ -623,9 +1458,10 @@ lval* lval_err(char* fmt, ...)
 
 lval* lval_add(lval* v, lval* x)
 {
+    lval_reserve(v, 0, 1);
+    v->buf->items[v->buf->hi++] = x;
+    LGC_BARRIER(v->buf, LGC_CELLS, x);
     v->count++;
-    v->cell = realloc(v->cell, sizeof(lval*) * v->count);
-    v->cell[v->count - 1] = x;
     return v;
 }
 
@@ -661,6 +1497,9 @@ lval* lval_read(mpc_ast_t* t)
         x = lval_qexpr();
     }
 
+    // children include brackets and comments, so this is an upper bound
+    lval_reserve(x, 0, t->children_num);
+
     for (int i = 0; i < t->children_num; i++) {
         if (strstr(t->children[i]->tag, "comment")) {
             continue;
@@ -687,15 +1526,9 @@ lval* lval_read(mpc_ast_t* t)
 
 lval* lval_pop(lval* v, int i)
 {
-    // find element at i
+    // find element at i, and close the gap it leaves
     lval* x = v->cell[i];
-
-    // shift memory over to left
-    memmove(&v->cell[i], &v->cell[i + 1], sizeof(lval*) * (v->count - i - 1));
-    v->count--;
-
-    // realloc
-    v->cell = realloc(v->cell, sizeof(lval*) * v->count);
+    lval_close(v, i, 1);
     return x;
 }
 
@@ -708,59 +1541,105 @@ lval* lval_take(lval* v, int i)
 
 lval* lval_join(lval* x, lval* y)
 {
-    // for each cell in y, add it to x
-    while (y->count) {
-        x = lval_add(x, lval_pop(y, 0));
+    if (y->count == 0) {
+        lval_del(y);
+        return x;
+    }
+    if (x->count == 0 && x->type == y->type) {
+        lval_del(x);
+        return y;
+    }
+
+    // splice x onto the front of y when y is the larger list and can
+    // be written to, as when a list is built up from the back by map
+    if (y->count > x->count && y->refs == 1 && y->buf->refs == 1) {
+        lval_trim(y);
+        lval_reserve(y, x->count, 0);
+        lcells* c = y->buf;
+        c->lo -= x->count;
+        y->cell = c->items + c->lo;
+        y->count += x->count;
+        y->type = x->type;
+        lval_splice(y->cell, x);
+        for (int i = c->lo; i < c->lo + y->count; i++) {
+            LGC_BARRIER(c, LGC_CELLS, c->items[i]);
+        }
+        return y;
+    }
+
+    // otherwise splice y onto the back of x
+    x = lval_unshare(x);
+    lval_reserve(x, 0, y->count);
+    lcells* c = x->buf;
+    int hi = c->hi;
+    c->hi += y->count;
+    x->count += y->count;
+    lval_splice(c->items + hi, y);
+    for (int i = hi; i < c->hi; i++) {
+        LGC_BARRIER(c, LGC_CELLS, c->items[i]);
     }
-    lval_del(y);
     return x;
 }
 
-lval* lval_call(lenv* e, lval* f, lval* a)
-{
-    // if is builtin, dispatch
-    if (f->builtin) {
-        return f->builtin(e, a);
-    }
+static lenv* lenv_frame(lenv* e, int extra);
+#ifndef CLISP_GC
+static lenv* lenv_push(lenv* e, int extra);
+#endif
+
+// bind the arguments a of the user function f, called in e, into a new
+// frame. Returns NULL once every formal is bound, with *out the frame to
+// evaluate f's body in, otherwise an error or f partially applied. heap
+// keeps the frame off the frame stack, for an evaluation that may pause.
+static lval* lval_bind(lenv* e, lval* f, lval* a, lenv** out, int heap)
+{
+    // f is only read: arguments are bound into a new frame holding its
+    // captured variables and whatever a partial application already
+    // bound. Lambdas copy what they capture rather than keep the frame,
+    // so only a partial application can outlive the call and the frame
+    // goes on the frame stack. The collector owns every env, so with it
+    // frames are on its heap.
+    lval* formals = f->formals;
+    call_stats.calls++;
+#ifdef CLISP_GC
+    lenv* frame = lenv_frame(f->env, formals->count);
+#else
+    lenv* frame = heap ? lenv_frame(f->env, formals->count) : lenv_push(f->env, formals->count);
+#endif
 
     // record argument counts
     int given = a->count;
-    int total = f->formals->count;
+    int total = formals->count;
+    int bound = 0;
 
     while (a->count) {
         // if we're run out of formal arguments to bind
-        if (f->formals->count == 0) {
+        if (bound == total) {
             lval_del(a);
+            lenv_del(frame);
             return lval_err("Function was passed too many arguments. Got %i expected %i",
                 given, total);
         }
 
-        // pop first symbol from the formals
-        lval* sym = lval_pop(f->formals, 0);
+        // take next symbol from the formals
+        lval* sym = formals->cell[bound++];
 
         // handle &
-        if (strcmp(sym->sym, "&") == 0) {
+        if (sym->sym == lsym_variadic()) {
             // ensure & is followed by a symbol
-            if (f->formals->count != 1) {
+            if (total - bound != 1) {
                 lval_del(a);
+                lenv_del(frame);
                 return lval_err("Function format invalid. Symbol '&' not followed by single symbol");
             }
 
             // nex format should be bound to remaining arguments
-            lval* nsym = lval_pop(f->formals, 0);
-            lenv_put(f->env, nsym, builtin_list(e, a));
-            lval_del(sym);
-            lval_del(nsym);
+            lenv_bind(frame, formals->cell[bound++], builtin_list(e, a));
             break;
         }
 
-        // pop next argument from the list
+        // pop next argument from the list and bind it
         lval* val = lval_pop(a, 0);
-
-        // bind a copy into the functions environment
-        lenv_put(f->env, sym, val);
-
-        lval_del(sym);
+        lenv_bind(frame, sym, val);
         lval_del(val);
     }
 
@@ -768,39 +1647,235 @@ lval* lval_call(lenv* e, lval* f, lval* a)
     lval_del(a);
 
     // if & remains in formal list bind to empty list
-    if (f->formals->count > 0 && strcmp(f->formals->cell[0]->sym, "&") == 0) {
-        if (f->formals->count != 2) {
+    if (bound < total && formals->cell[bound]->sym == lsym_variadic()) {
+        if (total - bound != 2) {
+            lenv_del(frame);
             return lval_err("Function format invalid. Symbol '&' not followed by single symbol");
         }
 
-        // pop and delete & symbol
-        lval_del(lval_pop(f->formals, 0));
-
-        // pop next symbol and create empty list
-        lval* sym = lval_pop(f->formals, 0);
         lval* val = lval_qexpr();
-
-        // bind to env and delete
-        lenv_put(f->env, sym, val);
-        lval_del(sym);
+        lenv_bind(frame, formals->cell[bound + 1], val);
         lval_del(val);
+        bound += 2;
+    }
+
+    // if all formals have been bound we can eval the body in the frame
+    if (bound == total) {
+        // under lexical scope the body sees its frame and the globals,
+        // under dynamic scope every frame of its callers too
+#ifdef CLISP_LEXICAL_SCOPE
+        frame->parent = e->global;
+#else
+        frame->parent = e;
+#endif
+        frame->global = e->global;
+        *out = frame;
+        return NULL;
     }
 
-    // if all formals have been bound we can eval
-    if (f->formals->count == 0) {
-        // set env parent to evaluation env
-        f->env->parent = e;
+    // otherwise return a partially applied function over the formals
+    // left, sharing f's. It outlives the call, so its frame can't stay
+    // on the stack.
+    if (frame->stacked) {
+        lenv* heap = lenv_copy(frame);
+        lenv_del(frame);
+        frame = heap;
+    }
+
+    lval* g = lval_new(LVAL_FUN);
+    g->env = frame;
+    g->formals = lval_slice(lval_retain(formals), bound, total - bound);
+    g->body = lval_retain(f->body);
+    g->code = lcode_retain(f->code);
+    g->folded = f->folded ? lval_retain(f->folded) : NULL;
+    g->fold_version = f->fold_version;
+    return g;
+}
+
+// the type of an argument a signature letter stands for, or -1 for any
+static int lsig_type(char c)
+{
+    switch (c) {
+    case 'n':
+        return LVAL_NUM;
+    case 's':
+        return LVAL_STR;
+    case 'q':
+        return LVAL_QEXPR;
+    }
+    return -1;
+}
+
+// the error for argument i of a not being of type, taking a
+static lval* lsig_mistyped(const lsig* sig, lval* a, int i, int type)
+{
+    lval* err = lval_err("Function '%s' passed incorrect type for argument %i. "
+                         "Got %s, Expected %s.",
+        sig->name, i, ltype_name(lval_type(a->cell[i])), ltype_name(type));
+    lval_del(a);
+    return err;
+}
+
+// check the arguments a against the signature of the builtin they are
+// passed to, returning NULL if they match or else an error taking a
+static lval* lsig_check(const lsig* sig, lval* a)
+{
+    int variadic = sig->variadic >= 0;
+    if (variadic ? a->count < sig->count : a->count != sig->count) {
+        lval* err = lval_err("Function '%s' passed incorrect number of arguments. "
+                             "Got %i, Expected %s%i.",
+            sig->name, a->count, variadic ? "at least " : "", sig->count);
+        lval_del(a);
+        return err;
+    }
+
+    // arguments before the variadic one each have a letter, the rest
+    // share its letter and are checked without looking it up again
+    int fixed = variadic ? sig->variadic : a->count;
+    for (int i = 0; i < fixed; i++) {
+        int type = lsig_type(sig->args[i]);
+        if (type >= 0 && lval_type(a->cell[i]) != type) {
+            return lsig_mistyped(sig, a, i, type);
+        }
+    }
+    int type = variadic ? lsig_type(sig->args[fixed]) : -1;
+    if (type >= 0) {
+        lval** cell = a->cell;
+        int count = a->count;
+        for (int i = fixed; i < count; i++) {
+            if (lval_type(cell[i]) != type) {
+                return lsig_mistyped(sig, a, i, type);
+            }
+        }
+    }
+    return NULL;
+}
+
+// call the builtin f on a, once they pass its signature
+static lval* lval_call_builtin(lenv* e, lval* f, lval* a)
+{
+    lval* err = lsig_check(f->sig, a);
+    return err ? err : f->builtin(e, a);
+}
+
+// A call in tail position isn't made by recursing, but left to the
+// lval_eval loop the evaluation returns to, so tail calls run in
+// constant C stack. lval_tail and lval_tail_call return &tail_call with
+// the work left in tail.
+static lval tail_call;
+static struct {
+    lval* fun; // applied to expr if set, else expr is evaluated
+    lval* expr;
+} tail;
+
+lval* lval_tail(lval* x)
+{
+    tail.fun = NULL;
+    tail.expr = x;
+    return &tail_call;
+}
+
+lval* lval_tail_call(lenv* e, lval* f, lval* a)
+{
+    if (f->builtin) {
+        return lval_call_builtin(e, f, a);
+    }
+    tail.fun = lval_retain(f);
+    tail.expr = a;
+    return &tail_call;
+}
+
+static lval* lval_step(lenv* e, lval* v);
+
+#ifndef CLISP_GC
+// set while lval_eval runs on the stack evaluator, see leval_enable
+#ifdef CLISP_STACK_EVAL
+static int stack_eval = 1;
+#else
+static int stack_eval = 0;
+#endif
+
+static lval* leval_eval(lenv* e, lval* v);
+static lval* leval_call(lenv* e, lval* f, lval* a);
+#endif
+
+// apply the function in tail, called from the frame *e, and start on its
+// body in the new frame. Under lexical scope nothing can see the
+// caller's frame any more, so unless it is outer the callee's replaces
+// it.
+static lval* lval_enter(lenv* outer, lenv** e)
+{
+    lval* f = tail.fun;
+    lval* a = tail.expr;
+#ifdef CLISP_LEXICAL_SCOPE
+    if (*e != outer) {
+        lenv_del(*e);
+        *e = outer;
+    }
+#endif
+
+    lenv* frame = NULL;
+    lval* x = lval_bind(*e, f, a, &frame, 0);
+    if (!x) {
+        *e = frame;
+        if (lvm_enabled()) {
+            x = lvm_call(frame, f);
+        } else {
+            lval* body = lval_unshare(lval_retain(lval_body(frame, f)));
+            body->type = LVAL_SEXPR;
+            x = lval_step(frame, body);
+        }
+    }
+    lval_del(f);
+    return x;
+}
+
+// delete the frames entered since outer, innermost first
+static void lval_leave(lenv* outer, lenv* e)
+{
+#ifdef CLISP_LEXICAL_SCOPE
+    if (e != outer) {
+        lenv_del(e);
+    }
+#else
+    while (e != outer) {
+        lenv* parent = e->parent;
+        lenv_del(e);
+        e = parent;
+    }
+#endif
+}
+
+// finish the calls x, a result of evaluating in e, leaves in tail
+static lval* lval_resume(lenv* outer, lenv* e, lval* x)
+{
+    while (x == &tail_call) {
+        x = tail.fun ? lval_enter(outer, &e) : lval_step(e, tail.expr);
+    }
+    lval_leave(outer, e);
+    return x;
+}
 
-        // evaluate and return
-        return builtin_eval(f->env, lval_add(lval_sexpr(), lval_copy(f->body)));
-    } else {
-        // return partially evaluated function
-        return lval_copy(f);
+lval* lval_call(lenv* e, lval* f, lval* a)
+{
+#ifndef CLISP_GC
+    if (stack_eval) {
+        return leval_call(e, f, a);
     }
+#endif
+    return lval_resume(e, e, lval_tail_call(e, f, a));
 }
 
 void lval_del(lval* v)
 {
+#ifdef CLISP_GC
+    // unreachable values are reclaimed by the collector
+    return;
+#endif
+    if (lval_is_fixnum(v) || --v->refs > 0) {
+        return;
+    }
+
     switch (v->type) {
     case LVAL_NUM:
         break;
@@ -809,34 +1884,35 @@ void lval_del(lval* v)
             lenv_del(v->env);
             lval_del(v->formals);
             lval_del(v->body);
+            lcode_release(v->code);
+            if (v->folded) {
+                lval_del(v->folded);
+            }
         }
         break;
     case LVAL_ERR:
         free(v->err);
         break;
     case LVAL_SYM:
-        free(v->sym);
         break;
     case LVAL_STR:
-        free(v->str);
+        lval_str_release(v);
         break;
     case LVAL_QEXPR:
-    case LVAL_SEXPR: {
-        for (int i = 0; i < v->count; i++) {
-            lval_del(v->cell[i]);
+    case LVAL_SEXPR:
+        if (v->buf) {
+            lcells_release(v->buf);
         }
-        free(v->cell);
         break;
     }
-    }
-    free(v);
+    lalloc_free(v, lval_size(v->type));
 }
 
 void lval_print(lval* v)
 {
-    switch (v->type) {
+    switch (lval_type(v)) {
     case LVAL_NUM:
-        printf("%li", v->num);
+        printf("%li", lval_to_num(v));
         break;
     case LVAL_ERR:
         printf("Error: %s", v->err);
@@ -875,74 +1951,255 @@ void lval_println(lval* v)
 
 ///////////////////////////////////////////////////////////////////////
 
-lenv* lenv_new(mpc_parser_t* lispy)
+// Env versions are drawn from one counter, so a version identifies both
+// an env and the state of its bindings.
+static unsigned long lenv_versions = 0;
+static lenv_cache_stats cache_stats;
+
+lenv_cache_stats lenv_get_cache_stats(void)
+{
+    return cache_stats;
+}
+
+static void lenv_init(lenv* e, mpc_parser_t* lispy)
 {
-    lenv* e = malloc(sizeof(lenv));
     e->lispy = lispy;
     e->parent = NULL;
+    e->global = e;
+    e->version = ++lenv_versions;
     e->count = 0;
+    e->capacity = 0;
     e->syms = NULL;
     e->vals = NULL;
+    e->index = NULL;
+    e->index_size = 0;
+    e->stacked = 0;
+}
+
+lenv* lenv_new(mpc_parser_t* lispy)
+{
+#ifdef CLISP_GC
+    lenv* e = lgc_alloc(sizeof(lenv), LGC_LENV);
+#else
+    lenv* e = lalloc(sizeof(lenv));
+#endif
+    lenv_init(e, lispy);
     return e;
 }
 
-lenv* lenv_copy(lenv* e)
+// bindings of a frame pushed with lenv_push sit right after it
+static int lenv_inline(lenv* e)
+{
+    return e->stacked && e->syms == (char**)(e + 1);
+}
+
+// grow e's binding arrays, which share one allocation, to capacity
+static void lenv_reserve(lenv* e, int capacity)
+{
+    if (capacity <= e->capacity) {
+        return;
+    }
+
+    char** syms = malloc((sizeof(char*) + sizeof(lval*)) * capacity);
+    lval** vals = (lval**)(syms + capacity);
+    if (e->count) {
+        memcpy(syms, e->syms, sizeof(char*) * e->count);
+        memcpy(vals, e->vals, sizeof(lval*) * e->count);
+    }
+    if (!lenv_inline(e)) {
+        free(e->syms);
+    }
+
+    e->syms = syms;
+    e->vals = vals;
+    e->capacity = capacity;
+}
+
+// give n, which has room for them, the parent and bindings of e
+static void lenv_inherit(lenv* n, lenv* e)
 {
-    lenv* n = lenv_new(e->lispy);
     n->parent = e->parent;
+    n->global = e->parent ? e->global : n;
     n->count = e->count;
-    n->syms = malloc(sizeof(char*) * n->count);
-    n->vals = malloc(sizeof(lval*) * n->count);
     for (int i = 0; i < e->count; i++) {
-        n->syms[i] = malloc(strlen(e->syms[i]) + 1);
-        strcpy(n->syms[i], e->syms[i]);
-        n->vals[i] = lval_copy(e->vals[i]);
+        n->syms[i] = e->syms[i];
+        n->vals[i] = lval_retain(e->vals[i]);
+        LGC_BARRIER(n, LGC_LENV, n->vals[i]);
+    }
+    if (e->index) {
+        n->index_size = e->index_size;
+        n->index = malloc(sizeof(int) * n->index_size);
+        memcpy(n->index, e->index, sizeof(int) * n->index_size);
     }
+}
+
+// a copy of e with room for extra more bindings
+static lenv* lenv_frame(lenv* e, int extra)
+{
+    lenv* n = lenv_new(e->lispy);
+    lenv_reserve(n, e->count + extra);
+    lenv_inherit(n, e);
+    return n;
+}
+
+#ifndef CLISP_GC
+// as lenv_frame, but pushed on the frame stack with its bindings inline.
+// It must be deleted before anything pushed ahead of it.
+static lenv* lenv_push(lenv* e, int extra)
+{
+    int capacity = e->count + extra;
+    lenv* n = lalloc_push(sizeof(lenv) + (sizeof(char*) + sizeof(lval*)) * capacity);
+    lenv_init(n, e->lispy);
+    n->stacked = 1;
+    n->capacity = capacity;
+    n->syms = (char**)(n + 1);
+    n->vals = (lval**)(n->syms + capacity);
+    lenv_inherit(n, e);
     return n;
 }
+#endif
+
+lenv* lenv_copy(lenv* e)
+{
+    return lenv_frame(e, 0);
+}
 
 void lenv_del(lenv* e)
 {
+#ifdef CLISP_GC
+    // unreachable envs are reclaimed by the collector
+    return;
+#endif
     for (int i = 0; i < e->count; i++) {
-        free(e->syms[i]);
         lval_del(e->vals[i]);
     }
-    free(e->syms);
-    free(e->vals);
-    free(e);
+    free(e->index);
+    if (!lenv_inline(e)) {
+        free(e->syms);
+    }
+
+    if (e->stacked) {
+        lalloc_pop(e);
+    } else {
+        lalloc_free(e, sizeof(lenv));
+    }
 }
 
-lval* lenv_get(lenv* e, lval* k)
+static unsigned lenv_hash(char* sym)
 {
-    for (int i = 0; i < e->count; i++) {
-        if (strcmp(e->syms[i], k->sym) == 0) {
-            return lval_copy(e->vals[i]);
-        }
+    // Fibonacci hashing of the pointer, taking the well mixed upper half
+    uint64_t h = (uint64_t)(uintptr_t)sym * 11400714819323198485ull;
+    return (unsigned)(h >> 32);
+}
+
+// the index slot holding sym, or the empty slot where it would go
+static int lenv_slot(lenv* e, char* sym)
+{
+    int mask = e->index_size - 1;
+    int slot = lenv_hash(sym) & mask;
+    while (e->index[slot] && e->syms[e->index[slot] - 1] != sym) {
+        slot = (slot + 1) & mask;
     }
-    if (e->parent) {
-        return lenv_get(e->parent, k);
-    } else {
-        return lval_err("Unbound symbol '%s'", k->sym);
+    return slot;
+}
+
+// rebuild the index at twice the size, keeping the load under a half
+static void lenv_reindex(lenv* e)
+{
+    free(e->index);
+    e->index_size = e->index_size ? e->index_size * 2 : 4 * LENV_SCAN;
+    e->index = calloc(e->index_size, sizeof(int));
+    for (int i = 0; i < e->count; i++) {
+        e->index[lenv_slot(e, e->syms[i])] = i + 1;
     }
 }
 
-void lenv_put(lenv* e, lval* k, lval* v)
+// position of sym's binding in e, or -1
+static inline int lenv_find(lenv* e, char* sym)
 {
+    if (e->count > LENV_SCAN) {
+        return e->index[lenv_slot(e, sym)] - 1;
+    }
     for (int i = 0; i < e->count; i++) {
-        if (strcmp(e->syms[i], k->sym) == 0) {
-            lval_del(e->vals[i]);
-            e->vals[i] = lval_copy(v);
-            return;
+        if (e->syms[i] == sym) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+lval* lenv_get(lenv* e, lval* k)
+{
+    // a parameter of the running lambda is found in the innermost frame
+    if (k->slot >= 0 && k->slot < e->count && e->syms[k->slot] == k->sym) {
+        return lval_retain(e->vals[k->slot]);
+    }
+
+    // a symbol which is never a parameter can only be bound globally, so
+    // skip the frames and use the cached slot while the env is unchanged
+    if (!lsym_is_local(k->sym)) {
+        lenv* g = e->global;
+        if (k->version == g->version) {
+            cache_stats.hits++;
+            return lval_retain(g->vals[k->global]);
+        }
+
+        cache_stats.misses++;
+        k->global = lenv_find(g, k->sym);
+        if (k->global < 0) {
+            return lval_err("Unbound symbol '%s'", k->sym);
+        }
+        k->version = g->version;
+        return lval_retain(g->vals[k->global]);
+    }
+
+    for (; e; e = e->parent) {
+        int i = lenv_find(e, k->sym);
+        if (i >= 0) {
+            return lval_retain(e->vals[i]);
         }
     }
+    return lval_err("Unbound symbol '%s'", k->sym);
+}
+
+// bind k to v in e. Only for function frames, which no lookup uses as
+// its global env, so the version is left alone.
+static void lenv_bind(lenv* e, lval* k, lval* v)
+{
+    int i = lenv_find(e, k->sym);
+    if (i >= 0) {
+        lval_del(e->vals[i]);
+        e->vals[i] = lval_retain(v);
+        LGC_BARRIER(e, LGC_LENV, v);
+        return;
+    }
+
+    if (e->count == e->capacity) {
+        lenv_reserve(e, e->capacity ? e->capacity * 2 : 4);
+    }
 
+    e->vals[e->count] = lval_retain(v);
+    LGC_BARRIER(e, LGC_LENV, v);
+    e->syms[e->count] = k->sym;
     e->count++;
-    e->vals = realloc(e->vals, sizeof(lval*) * e->count);
-    e->syms = realloc(e->syms, sizeof(char*) * e->count);
 
-    e->vals[e->count - 1] = lval_copy(v);
-    e->syms[e->count - 1] = malloc(strlen(k->sym) + 1);
-    strcpy(e->syms[e->count - 1], k->sym);
+    if (e->index && e->count * 2 <= e->index_size) {
+        e->index[lenv_slot(e, k->sym)] = e->count;
+    } else if (e->count > LENV_SCAN) {
+        lenv_reindex(e);
+    }
+}
+
+void lenv_put(lenv* e, lval* k, lval* v)
+{
+    // a binding below the global env can shadow a global
+    lsym_rebind(e, k->sym);
+    if (e->parent) {
+        lsym_mark_local(k->sym);
+    }
+
+    lenv_bind(e, k, v);
+    e->version = ++lenv_versions;
 }
 
 void lenv_def(lenv* e, lval* k, lval* v)
@@ -953,49 +2210,72 @@ void lenv_def(lenv* e, lval* k, lval* v)
     lenv_put(e, k, v);
 }
 
-void lenv_add_builtin(lenv* e, char* name, lbuiltin func)
+void lenv_add_builtin(lenv* e, lsig* sig)
 {
-    lval* k = lval_sym(name);
-    lval* v = lval_fun(func);
+    sig->count = 0;
+    sig->variadic = -1;
+    for (const char* t = sig->args; *t; t++) {
+        if (t[1] == '*') {
+            sig->variadic = sig->count;
+            t++;
+        } else {
+            sig->count++;
+        }
+    }
+
+    lval* k = lval_sym(sig->name);
+    lval* v = lval_fun(sig);
     lenv_put(e, k, v);
     lval_del(k);
     lval_del(v);
 }
 
-void lenv_add_default_builtins(lenv* e, lgrammar* g)
-{
+static lsig default_builtins[] = {
     // List Functions
-    lenv_add_builtin(e, "list", builtin_list);
-    lenv_add_builtin(e, "head", builtin_head);
-    lenv_add_builtin(e, "tail", builtin_tail);
-    lenv_add_builtin(e, "eval", builtin_eval);
-    lenv_add_builtin(e, "join", builtin_join);
+    { "list", builtin_list, "a*", 1 },
+    { "head", builtin_head, "q", 1 },
+    { "tail", builtin_tail, "q", 1 },
+    { "eval", builtin_eval, "q", 0 },
+    { "join", builtin_join, "qq*", 1 },
 
     // Mathematical Functions
-    lenv_add_builtin(e, "+", builtin_add);
-    lenv_add_builtin(e, "-", builtin_sub);
-    lenv_add_builtin(e, "*", builtin_mul);
-    lenv_add_builtin(e, "/", builtin_div);
-    lenv_add_builtin(e, "%", builtin_mod);
+    { "+", builtin_add, "nn*", 1 },
+    { "-", builtin_sub, "nn*", 1 },
+    { "*", builtin_mul, "nn*", 1 },
+    { "/", builtin_div, "nn*", 1 },
+    { "%", builtin_mod, "nn*", 1 },
 
     // user definitions
-    lenv_add_builtin(e, "def", builtin_def);
-    lenv_add_builtin(e, "\\", builtin_lambda);
-    lenv_add_builtin(e, "=", builtin_put);
+    { "def", builtin_def, "qa*", 0 },
+    { "\\", builtin_lambda, "qq", 0 },
+    { "=", builtin_put, "qa*", 0 },
+
+    // sequence and scope
+    { "do", builtin_do, "aa*", 0 },
+    { "let", builtin_let, "q", 0 },
 
     // comparison/conditionals
-    lenv_add_builtin(e, "if", builtin_if);
-    lenv_add_builtin(e, "==", builtin_eq);
-    lenv_add_builtin(e, "!=", builtin_ne);
-    lenv_add_builtin(e, ">", builtin_gt);
-    lenv_add_builtin(e, "<", builtin_lt);
-    lenv_add_builtin(e, ">=", builtin_ge);
-    lenv_add_builtin(e, "<=", builtin_le);
+    { "if", builtin_if, "nqq", 0 },
+    { "select", builtin_select, "q*", 0 },
+    { "case", builtin_case, "aq*", 0 },
+    { "==", builtin_eq, "aa", 1 },
+    { "!=", builtin_ne, "aa", 1 },
+    { ">", builtin_gt, "nn", 1 },
+    { "<", builtin_lt, "nn", 1 },
+    { ">=", builtin_ge, "nn", 1 },
+    { "<=", builtin_le, "nn", 1 },
 
     // helpers
-    lenv_add_builtin(e, "load", builtin_load);
-    lenv_add_builtin(e, "print", builtin_print);
-    lenv_add_builtin(e, "error", builtin_error);
+    { "load", builtin_load, "s", 0 },
+    { "print", builtin_print, "a*", 0 },
+    { "error", builtin_error, "s", 0 },
+};
+
+void lenv_add_default_builtins(lenv* e, lgrammar* g)
+{
+    for (int i = 0; i < sizeof(default_builtins) / sizeof(default_builtins[0]); i++) {
+        lenv_add_builtin(e, &default_builtins[i]);
+    }
 }
 
 ///////////////////////////////////////////////////////////////////////
@@ -1039,31 +2319,116 @@ void lgrammar_del(lgrammar* g)
 
 ///////////////////////////////////////////////////////////////////////
 
-lval* lval_eval(lenv* e, lval* v)
+static lval* lval_eval_list(lenv* e, lval* v);
+static lval* lval_apply(lenv* e, lval* v);
+
+// evaluate v in e, up to a call in tail position
+static lval* lval_step(lenv* e, lval* v)
 {
-    if (v->type == LVAL_SYM) {
+#ifdef CLISP_GC
+    lgc_safepoint(e, &v);
+#endif
+
+    if (lval_type(v) == LVAL_SYM) {
         lval* x = lenv_get(e, v);
         lval_del(v);
         return x;
     }
 
     // eval sexprs, otherwise pass on
-    if (v->type == LVAL_SEXPR) {
-        return lval_eval_sexpr(e, v);
+    if (lval_type(v) == LVAL_SEXPR) {
+        return lval_eval_list(e, v);
     }
     return v;
 }
 
+lval* lval_eval(lenv* e, lval* v)
+{
+#ifndef CLISP_GC
+    if (stack_eval && lval_type(v) == LVAL_SEXPR) {
+        return leval_eval(e, v);
+    }
+#endif
+    lval* x = lval_step(e, v);
+    return x == &tail_call ? lval_resume(e, e, x) : x;
+}
+
 lval* lval_eval_sexpr(lenv* e, lval* v)
 {
-    // eval children
-    for (int i = 0; i < v->count; i++) {
+#ifndef CLISP_GC
+    if (stack_eval) {
+        return leval_eval(e, v);
+    }
+#endif
+    lval* x = lval_eval_list(e, v);
+    return x == &tail_call ? lval_resume(e, e, x) : x;
+}
+
+// Special forms: once the first n elements of the list v are evaluated,
+// an application of if to a number and two Q-expressions evaluates just
+// the branch it picks, and one of do its last argument, in tail
+// position and taking v. Otherwise NULL, and v goes on to be evaluated
+// and applied as any other list, so errors and redefinitions of if and
+// do are the builtins'.
+static lval* lval_form(lval* v, int n)
+{
+    if (n != 2 && n != v->count - 1) {
+        return NULL;
+    }
+    lval* f = v->cell[0];
+    if (lval_type(f) != LVAL_FUN) {
+        return NULL;
+    }
+
+    if (f->builtin == builtin_if) {
+        if (n != 2 || v->count != 4 || lval_type(v->cell[1]) != LVAL_NUM
+            || lval_type(v->cell[2]) != LVAL_QEXPR || lval_type(v->cell[3]) != LVAL_QEXPR) {
+            return NULL;
+        }
+        // the branch is code shared with the body, so is only made
+        // private to mark it evaluable, and the other is left alone
+        lval* x = lval_unshare(lval_take(v, lval_to_num(v->cell[1]) ? 2 : 3));
+        x->type = LVAL_SEXPR;
+        return lval_tail(x);
+    }
+
+    if (f->builtin == builtin_do && n == v->count - 1) {
+        // the first error is the result, as an application's is
+        for (int i = 1; i < n; i++) {
+            if (lval_type(v->cell[i]) == LVAL_ERR) {
+                return NULL;
+            }
+        }
+        return lval_tail(lval_take(v, n));
+    }
+    return NULL;
+}
+
+static lval* lval_eval_list(lenv* e, lval* v)
+{
+    // children are evaluated in place
+    v = lval_unshare(v);
+
+    // eval children, unless a special form takes over
+    lval* x = NULL;
+    LGC_ROOT_ENV(e);
+    LGC_ROOT(v);
+    for (int i = 0; !x && i < v->count; i++) {
         v->cell[i] = lval_eval(e, v->cell[i]);
+        LGC_BARRIER(v->buf, LGC_CELLS, v->cell[i]);
+        x = lval_form(v, i + 1);
     }
+    LGC_UNROOT(2);
+
+    return x ? x : lval_apply(e, v);
+}
 
+// apply the evaluated list v, up to a call in tail position
+static lval* lval_apply(lenv* e, lval* v)
+{
     // error checking
     for (int i = 0; i < v->count; i++) {
-        if (v->cell[i]->type == LVAL_ERR) {
+        if (lval_type(v->cell[i]) == LVAL_ERR) {
             return lval_take(v, i);
         }
     }
@@ -1080,14 +2445,363 @@ lval* lval_eval_sexpr(lenv* e, lval* v)
 
     // first element must be a function after evaluation
     lval* f = lval_pop(v, 0);
-    if (f->type != LVAL_FUN) {
-        lval* err = lval_err("S-expression must start with a function. Got '%s', expected: '%s'", ltype_name(f->type), ltype_name(LVAL_FUN));
+    if (lval_type(f) != LVAL_FUN) {
+        lval* err = lval_err("S-expression must start with a function. Got '%s', expected: '%s'", ltype_name(lval_type(f)), ltype_name(LVAL_FUN));
         lval_del(v);
         lval_del(f);
         return err;
     }
 
-    lval* result = lval_call(e, f, v);
+    // the call is in tail position, and f goes with it
+    if (!f->builtin) {
+        tail.fun = f;
+        tail.expr = v;
+        return &tail_call;
+    }
+    lval* result = lval_call_builtin(e, f, v);
+    lval_del(f);
+    return result;
+}
+
+///////////////////////////////////////////////////////////////////////
+
+// The stack evaluator doesn't recurse. What is left to do once a value
+// is known goes on its own stack as a continuation: the rest of a list
+// whose children are being evaluated, or the frames to delete when a
+// body returns. Each step evaluates an expression up to the point it
+// needs the value of another, or hands a value to the continuation on
+// top.
+
+static int stack_limit = 0;
+
+#ifndef CLISP_GC
+
+enum {
+    LEVAL_ARGS, // evaluate the children of list in env, from i on
+    LEVAL_LEAVE // delete the frames from env back to outer
+};
+
+typedef struct {
+    int kind;
+    int i;
+    lval* list;
+    lenv* env;
+    lenv* outer;
+} lcont;
+
+struct leval {
+    lcont* stack;
+    int count;
+    int capacity;
+    int heap; // frames are kept off the frame stack, so it can pause
+    int base; // continuations of the machines it runs inside of
+
+    // x is evaluated in env if eval is set, otherwise it is the value
+    // for the continuation on top, or the result once there is none
+    lval* x;
+    lenv* env;
+    int eval;
+};
+
+// a machine for lval_eval to reuse, unless one is running already
+static leval* idle;
+
+// the machine taking steps. Builtins which evaluate, like select and
+// load, run another inside one of its steps.
+static leval* running;
+
+static leval* leval_start(lenv* e, lval* v, int heap)
+{
+    leval* s = malloc(sizeof(leval));
+    s->stack = NULL;
+    s->count = 0;
+    s->capacity = 0;
+    s->heap = heap;
+    s->base = 0;
+    s->x = v;
+    s->env = e;
+    s->eval = 1;
+    return s;
+}
+
+// a new continuation on top, or NULL past the depth limit, which counts
+// those of the machines s runs inside of too
+static lcont* leval_push(leval* s, int kind)
+{
+    if (stack_limit && s->base + s->count >= stack_limit) {
+        return NULL;
+    }
+    if (s->count == s->capacity) {
+        s->capacity = s->capacity ? s->capacity * 2 : 64;
+        s->stack = realloc(s->stack, sizeof(lcont) * s->capacity);
+    }
+    lcont* k = &s->stack[s->count++];
+    k->kind = kind;
+    return k;
+}
+
+static lval* leval_too_deep(void)
+{
+    return lval_err("Evaluation nested deeper than the limit of %i", stack_limit);
+}
+
+static void leval_value(leval* s, lval* x)
+{
+    s->x = x;
+    s->eval = 0;
+}
+
+static void leval_expr(leval* s, lenv* e, lval* x)
+{
+    s->x = x;
+    s->env = e;
+    s->eval = 1;
+}
+
+// apply the user function f to a, taking both, called from e. When the
+// value of the call is that of the body e is the frame of, the call
+// takes over the body's continuation instead of pushing another, so
+// tail calls don't grow the stack.
+static void leval_enter(leval* s, lenv* e, lval* f, lval* a)
+{
+    lcont* k = s->count ? &s->stack[s->count - 1] : NULL;
+    int tail = k && k->kind == LEVAL_LEAVE && k->env == e;
+#ifdef CLISP_LEXICAL_SCOPE
+    // nothing can see the caller's frame any more
+    if (tail && e != k->outer) {
+        lenv_del(e);
+        e = k->env = k->outer;
+    }
+#endif
+
+    lenv* frame = NULL;
+    lval* x = lval_bind(e, f, a, &frame, s->heap);
+    if (!x) {
+        if (tail) {
+            k->env = frame;
+        } else if ((k = leval_push(s, LEVAL_LEAVE))) {
+            k->env = frame;
+            k->outer = e;
+        } else {
+            lval_leave(e, frame);
+            x = leval_too_deep();
+        }
+    }
+    if (x) {
+        lval_del(f);
+        leval_value(s, x);
+        return;
+    }
+
+    lval* body = lval_unshare(lval_retain(lval_body(frame, f)));
+    body->type = LVAL_SEXPR;
     lval_del(f);
+    leval_expr(s, frame, body);
+}
+
+// carry on from x, the result of an application in e
+static void leval_tail(leval* s, lenv* e, lval* x)
+{
+    if (x != &tail_call) {
+        leval_value(s, x);
+    } else if (!tail.fun) {
+        leval_expr(s, e, tail.expr);
+    } else {
+        leval_enter(s, e, tail.fun, tail.expr);
+    }
+}
+
+// evaluate children of the list on top up to one needing steps of its
+// own, or apply the list once they are all done. A special form carries
+// on in its place once the children it needs are.
+static void leval_next(leval* s)
+{
+    lcont* k = &s->stack[s->count - 1];
+    lval* v = k->list;
+    for (; k->i < v->count; k->i++) {
+        lval* x = k->i ? lval_form(v, k->i) : NULL;
+        if (x) {
+            lenv* e = k->env;
+            s->count--;
+            leval_tail(s, e, x);
+            return;
+        }
+
+        lval* c = v->cell[k->i];
+        if (lval_type(c) == LVAL_SYM) {
+            v->cell[k->i] = lenv_get(k->env, c);
+            lval_del(c);
+        } else if (lval_type(c) == LVAL_SEXPR) {
+            // the cell holds a number until c's value comes back
+            v->cell[k->i] = lval_num(0);
+            leval_expr(s, k->env, c);
+            return;
+        }
+    }
+
+    lenv* e = k->env;
+    s->count--;
+    leval_tail(s, e, lval_apply(e, v));
+}
+
+// take up to steps steps, returning the result if that finishes
+static lval* leval_steps(leval* s, long steps)
+{
+    leval* outer = running;
+    s->base = outer ? outer->base + outer->count : 0;
+    running = s;
+
+    lval* result = NULL;
+    for (; steps > 0 && !result; steps--) {
+        if (s->eval) {
+            lval* x = s->x;
+            if (lval_type(x) == LVAL_SYM) {
+                leval_value(s, lenv_get(s->env, x));
+                lval_del(x);
+            } else if (lval_type(x) != LVAL_SEXPR) {
+                s->eval = 0;
+            } else {
+                lcont* k = leval_push(s, LEVAL_ARGS);
+                if (!k) {
+                    lval_del(x);
+                    leval_value(s, leval_too_deep());
+                    continue;
+                }
+                k->list = lval_unshare(x);
+                k->env = s->env;
+                k->i = 0;
+                leval_next(s);
+            }
+        } else if (s->count) {
+            lcont* k = &s->stack[s->count - 1];
+            if (k->kind == LEVAL_LEAVE) {
+                lval_leave(k->outer, k->env);
+                s->count--;
+            } else {
+                k->list->cell[k->i++] = s->x;
+                leval_next(s);
+            }
+        } else {
+            result = s->x;
+            s->x = NULL;
+        }
+    }
+
+    running = outer;
     return result;
 }
+
+static lval* leval_finish(leval* s)
+{
+    lval* x = leval_steps(s, LONG_MAX);
+    if (idle) {
+        free(s->stack);
+        free(s);
+    } else {
+        idle = s;
+    }
+    return x;
+}
+
+static lval* leval_eval(lenv* e, lval* v)
+{
+    leval* s = idle ? idle : leval_start(e, v, 0);
+    idle = NULL;
+    leval_expr(s, e, v);
+    return leval_finish(s);
+}
+
+static lval* leval_call(lenv* e, lval* f, lval* a)
+{
+    leval* s = idle ? idle : leval_start(e, NULL, 0);
+    idle = NULL;
+    leval_tail(s, e, lval_tail_call(e, f, a));
+    return leval_finish(s);
+}
+
+void leval_enable(int on)
+{
+    stack_eval = on;
+}
+
+int leval_enabled(void)
+{
+    return stack_eval;
+}
+
+void leval_set_limit(int depth)
+{
+    stack_limit = depth;
+}
+
+leval* leval_new(lenv* e, lval* v)
+{
+    return leval_start(e, v, 1);
+}
+
+lval* leval_run(leval* s, long steps)
+{
+    return leval_steps(s, steps);
+}
+
+void leval_del(leval* s)
+{
+    // drop what is left to do, innermost first
+    if (s->x) {
+        lval_del(s->x);
+    }
+    while (s->count) {
+        lcont* k = &s->stack[--s->count];
+        if (k->kind == LEVAL_LEAVE) {
+            lval_leave(k->outer, k->env);
+        } else {
+            lval_del(k->list);
+        }
+    }
+    free(s->stack);
+    free(s);
+}
+
+#else
+
+// the collector can't see the stack, so evaluation runs in one go
+struct leval {
+    lenv* env;
+    lval* x;
+};
+
+void leval_enable(int on)
+{
+}
+
+int leval_enabled(void)
+{
+    return 0;
+}
+
+void leval_set_limit(int depth)
+{
+    stack_limit = depth;
+}
+
+leval* leval_new(lenv* e, lval* v)
+{
+    leval* s = malloc(sizeof(leval));
+    s->env = e;
+    s->x = v;
+    return s;
+}
+
+lval* leval_run(leval* s, long steps)
+{
+    lval* x = lval_eval(s->env, s->x);
+    s->x = NULL;
+    return x;
+}
+
+void leval_del(leval* s)
+{
+    free(s);
+}
+
+#endif
@@ -1,21 +1,50 @@
 #ifndef LIB_CLISP_H
 #define LIB_CLISP_H
 
+#include <limits.h>
+#include <stdint.h>
+
 #include "../libmpc/mpc.h"
+#include "lalloc.h"
+#include "lgc.h"
+#include "lsym.h"
+#include "lvm.h"
 
 ///////////////////////////////////////////////////////////////////////
 
 struct lval;
 struct lenv;
+struct lcells;
+struct lstr;
 struct lgrammar;
 typedef struct lval lval;
 typedef struct lenv lenv;
+typedef struct lcells lcells;
+typedef struct lstr lstr;
 typedef struct lgrammar lgrammar;
 
 ///////////////////////////////////////////////////////////////////////
 
 typedef lval* (*lbuiltin)(lenv*, lval*);
 
+// A builtin as registered, with the arguments it takes. args has a
+// letter for the type of each one: n(umber), s(tring), q(-expression)
+// or a(ny). A letter followed by * stands for any number of arguments of
+// that type, so "nn*" is one or more numbers. Calls are checked against
+// args before the builtin runs, which leaves it only the checks args
+// can't express. A pure builtin has no effects and its result depends
+// only on its arguments, so calls of it on constants can be folded.
+// count and variadic are worked out from args as the builtin is
+// registered, so calls don't have to parse it.
+typedef struct {
+    char* name;
+    lbuiltin builtin;
+    char* args;
+    int pure;
+    int count; // arguments taken, or the fewest if variadic
+    int variadic; // index of the argument * repeats, or -1
+} lsig;
+
 enum {
     LVAL_ERR,
     LVAL_NUM,
@@ -28,54 +57,198 @@ enum {
 
 char* ltype_name(int t);
 
+// strings shorter than this are stored in the lval itself
+#define LVAL_STR_INLINE 16
+
+// lval is a tagged union. Values are allocated at the size of their
+// type's payload (see lval_size), so only the union member matching
+// `type` may be touched.
+//
+// Values are reference counted and shared: lenv_get and lenv_put only
+// take a new reference. A value must be treated as immutable unless it
+// was just returned by lval_unshare, which copies it when other
+// references exist. lval_del drops one reference. When built with the
+// tracing collector (see lgc.h) refs only records whether a value has
+// ever been shared.
 typedef struct lval {
     int type;
+    int refs;
 
-    // basics
-    long num;
-    char* err;
-    char* sym;
-    char* str;
+    union {
+        // basics
+        long num;
+        char* err;
 
-    // function - either builtin or defined by user
-    lbuiltin builtin;
-    lenv* env;
-    lval* formals;
-    lval* body;
+        // sym, interned. slot remembers where the symbol is bound in the
+        // frame of a lambda it is a parameter of, a hint checked on use.
+        // global is an inline cache of its slot in the global env, valid
+        // while that env's version is still version.
+        struct {
+            char* sym;
+            int slot;
+            int global;
+            unsigned long version;
+        };
 
-    int count;
-    struct lval** cell;
+        // str, immutable and length prefixed; read it with lval_to_str
+        struct {
+            int len;
+            uint32_t hash;
+            union {
+                lstr* text;
+                char small[LVAL_STR_INLINE];
+            };
+        };
+
+        // function - either builtin, with the signature it was
+        // registered with, or defined by user. code is the body compiled
+        // by the vm, once it has run there. folded is the body with its
+        // constant parts folded, if it has been, valid while fold_version
+        // is current (see lval_fold).
+        struct {
+            lbuiltin builtin;
+            union {
+                const lsig* sig;
+                lenv* env;
+            };
+            lval* formals;
+            lval* body;
+            lcode* code;
+            lval* folded;
+            unsigned long fold_version;
+        };
+
+        // sexpr & qexpr, a view of count cells in buf
+        struct {
+            int count;
+            struct lval** cell;
+            lcells* buf;
+        };
+    };
 } lval;
 
+// Cell buffer behind sexprs and qexprs. Several lists may view (parts
+// of) the same buffer, which is how tail and head avoid copying;
+// items[lo, hi) each hold one reference. A list may only be written
+// to once lval_unshare has given it sole use of its buffer.
+struct lcells {
+    int refs;
+    int lo;
+    int hi;
+    int cap;
+    struct lval** items;
+};
+
+// Text of a string too long to store inline, shared by every copy of
+// the string.
+struct lstr {
+    int refs;
+    char chars[];
+};
+
+size_t lval_size(int type);
+
+// Numbers which fit in 63 bits are not allocated at all; they are stored
+// in the lval pointer itself with the low bit set. Such a pointer must
+// never be dereferenced, so use lval_type() and lval_to_num() rather than
+// reading v->type or v->num on a value which may be a number.
+
+#define LVAL_FIXNUM_MIN (LONG_MIN >> 1)
+#define LVAL_FIXNUM_MAX (LONG_MAX >> 1)
+
+static inline int lval_is_fixnum(const lval* v)
+{
+    return ((uintptr_t)v & 1) != 0;
+}
+
+static inline int lval_type(const lval* v)
+{
+    return lval_is_fixnum(v) ? LVAL_NUM : v->type;
+}
+
+static inline long lval_to_num(const lval* v)
+{
+    return lval_is_fixnum(v) ? (long)((intptr_t)v >> 1) : v->num;
+}
+
+static inline char* lval_to_str(lval* v)
+{
+    return v->len < LVAL_STR_INLINE ? v->small : v->text->chars;
+}
+
 lval* lval_load(lenv* e, char* file);
 lval* lval_copy(lval* v);
+lval* lval_retain(lval* v);
+lval* lval_unshare(lval* v);
+
+// drop v's share of its text, for use when v itself is freed
+void lval_str_release(lval* v);
 lval* lval_num(long x);
 lval* lval_sym(char* s);
 lval* lval_str(char* s);
 lval* lval_sexpr();
 lval* lval_qexpr();
-lval* lval_fun(lbuiltin fun);
-lval* lval_lambda(lval* formals, lval* body);
+lval* lval_fun(const lsig* sig);
+lval* lval_lambda(lenv* e, lval* formals, lval* body);
+
+// Lambdas made by \ have their bodies folded unless this is turned off,
+// which only affects lambdas made afterwards.
+void lval_fold_enable(int on);
+int lval_fold_enabled(void);
+
+// Calls of a lambda bound to a global are inlined into bodies as they
+// are folded, if its body has at most this many values. 0 turns it off.
+#ifndef LVAL_INLINE_BUDGET
+#define LVAL_INLINE_BUDGET 16
+#endif
+
+void lval_set_inline_budget(int budget);
+
+// the body a call of the user function f from e evaluates: the folded
+// one if it has one, folded again first if globals it was folded on
+// have been rebound, which drops the code the vm compiled from it
+lval* lval_body(lenv* e, lval* f);
+
+typedef struct {
+    long calls; // of lambdas, since the start
+    long inlined; // call sites given the lambda's body instead, as bodies are folded
+} lval_call_stats;
+
+lval_call_stats lval_get_call_stats(void);
 lval* lval_err(char* fmt, ...);
 lval* lval_add(lval* v, lval* x);
 lval* lval_read_num(mpc_ast_t* t);
 lval* lval_read(mpc_ast_t* t);
 lval* lval_pop(lval* v, int i);
 lval* lval_take(lval* v, int i);
+lval* lval_slice(lval* v, int start, int count);
+lval* lval_remove(lval* v, int start, int count);
 lval* lval_join(lval* x, lval* y);
 lval* lval_call(lenv* e, lval* f, lval* a);
+int lval_eq(lval* x, lval* y);
 void lval_del(lval* v);
 void lval_print(lval* v);
 void lval_println(lval* v);
 
 ///////////////////////////////////////////////////////////////////////
 
+// Bindings are kept in definition order in syms/vals. Once an env
+// holds more than LENV_SCAN of them, lookups go through index, an open
+// addressing table of (entry + 1) keyed by symbol pointer, 0 if empty.
+#define LENV_SCAN 8
+
 struct lenv {
     mpc_parser_t* lispy;
     lenv* parent;
+    lenv* global; // root of the parent chain
+    unsigned long version; // changes whenever a binding is added or replaced
     int count;
-    char** syms;
-    lval** vals;
+    int capacity;
+    char** syms; // interned, compared by pointer
+    lval** vals; // allocated with syms, not separately
+    int* index;
+    int index_size; // a power of two, or 0 before the index is built
+    int stacked; // a call frame on the frame stack, see lalloc_push
 };
 
 lenv* lenv_new(mpc_parser_t* lispy);
@@ -84,9 +257,19 @@ void lenv_del(lenv* e);
 lval* lenv_get(lenv* e, lval* k);
 void lenv_put(lenv* e, lval* k, lval* v);
 void lenv_def(lenv* e, lval* k, lval* v);
-void lenv_add_builtin(lenv* e, char* name, lbuiltin func);
+
+// sig must outlive e. Its count and variadic are filled in.
+void lenv_add_builtin(lenv* e, lsig* sig);
 void lenv_add_default_builtins(lenv* e, lgrammar* g);
 
+// counts of global lookups answered by a symbol's inline cache
+typedef struct {
+    long hits;
+    long misses;
+} lenv_cache_stats;
+
+lenv_cache_stats lenv_get_cache_stats(void);
+
 ///////////////////////////////////////////////////////////////////////
 
 struct lgrammar {
@@ -105,7 +288,60 @@ void lgrammar_del(lgrammar* grammar);
 
 ///////////////////////////////////////////////////////////////////////
 
+// if and do are special forms while bound to their builtins: once the
+// condition of an (if cond {then} {else}) is known only the branch it
+// picks is evaluated, and the last argument of a do once the others
+// are, both in tail position rather than as arguments copied into a
+// call. Their builtins take the place of an application otherwise.
 lval* lval_eval(lenv* e, lval* v);
 lval* lval_eval_sexpr(lenv* e, lval* v);
 
+// For builtins and engines, to make a call in tail position without
+// recursing: the lval_eval this returns to evaluates x in the same env,
+// or applies f to a. Their results must be returned as they are.
+lval* lval_tail(lval* x);
+lval* lval_tail_call(lenv* e, lval* f, lval* a);
+
+// Evaluation on an explicit stack of continuations instead of the C
+// stack, which lval_eval and lval_call use while it is enabled, as it is
+// when libclisp is built with CLISP_STACK_EVAL (meson -Dengine=stack).
+// Recursion is then only limited by memory, or by leval_set_limit: an
+// evaluation more than depth continuations deep returns an error. That
+// counts those of the evaluations builtins like select and load start
+// within it, which recurse in C, so the limit bounds them too. While
+// enabled it takes over from the vm. The collector can't see its stack,
+// so builds with CLISP_GC can't enable it.
+void leval_enable(int on);
+int leval_enabled(void);
+void leval_set_limit(int depth); // 0 for no limit
+
+// An evaluation of v in e which can be paused between steps: leval_run
+// takes up to steps more and returns the result once there is one,
+// otherwise NULL. Builtins which evaluate, like load, run in one step.
+// leval_del drops whatever is left of it. With the collector leval_run
+// evaluates v in one go, and v has to stay rooted until then.
+typedef struct leval leval;
+
+leval* leval_new(lenv* e, lval* v);
+lval* leval_run(leval* s, long steps);
+void leval_del(leval* s);
+
+// builtins the vm has opcodes for
+lval* builtin_add(lenv* e, lval* a);
+lval* builtin_sub(lenv* e, lval* a);
+lval* builtin_mul(lenv* e, lval* a);
+lval* builtin_div(lenv* e, lval* a);
+lval* builtin_mod(lenv* e, lval* a);
+lval* builtin_gt(lenv* e, lval* a);
+lval* builtin_lt(lenv* e, lval* a);
+lval* builtin_ge(lenv* e, lval* a);
+lval* builtin_le(lenv* e, lval* a);
+lval* builtin_eq(lenv* e, lval* a);
+lval* builtin_ne(lenv* e, lval* a);
+lval* builtin_head(lenv* e, lval* a);
+lval* builtin_tail(lenv* e, lval* a);
+lval* builtin_if(lenv* e, lval* a);
+lval* builtin_do(lenv* e, lval* a);
+lval* builtin_lambda(lenv* e, lval* a);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,95 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lsym.h"
+
+#define LSYM_INITIAL_CAPACITY 256
+
+// open addressing with linear probing; capacity is always a power of two
+static char** table = NULL;
+static int capacity = 0;
+static int count = 0;
+
+uint32_t lsym_hash(char* name)
+{
+    // FNV-1a
+    uint32_t h = 2166136261u;
+    for (char* c = name; *c; c++) {
+        h ^= (unsigned char)*c;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void lsym_grow()
+{
+    int old_capacity = capacity;
+    char** old_table = table;
+
+    capacity = capacity ? capacity * 2 : LSYM_INITIAL_CAPACITY;
+    table = calloc(capacity, sizeof(char*));
+
+    for (int i = 0; i < old_capacity; i++) {
+        if (old_table[i]) {
+            uint32_t slot = lsym_hash(old_table[i]) & (capacity - 1);
+            while (table[slot]) {
+                slot = (slot + 1) & (capacity - 1);
+            }
+            table[slot] = old_table[i];
+        }
+    }
+    free(old_table);
+}
+
+char* lsym_intern(char* name)
+{
+    // keep load factor under 3/4
+    if ((count + 1) * 4 > capacity * 3) {
+        lsym_grow();
+    }
+
+    uint32_t slot = lsym_hash(name) & (capacity - 1);
+    while (table[slot]) {
+        if (strcmp(table[slot], name) == 0) {
+            return table[slot];
+        }
+        slot = (slot + 1) & (capacity - 1);
+    }
+
+    // leave room for the marks in front of the name
+    char* sym = malloc(strlen(name) + 2) + 1;
+    sym[-1] = 0;
+    strcpy(sym, name);
+    table[slot] = sym;
+    count++;
+    return sym;
+}
+
+void lsym_mark(char* sym, int marks)
+{
+    sym[-1] |= marks;
+}
+
+void lsym_mark_local(char* sym)
+{
+    lsym_mark(sym, LSYM_LOCAL);
+}
+
+int lsym_count(void)
+{
+    return count;
+}
+
+void lsym_release(void)
+{
+    for (int i = 0; i < capacity; i++) {
+        if (table[i]) {
+            free(table[i] - 1);
+        }
+    }
+    free(table);
+    table = NULL;
+    capacity = 0;
+    count = 0;
+}
@@ -0,0 +1,45 @@
+#ifndef LIB_CLISP_LSYM_H
+#define LIB_CLISP_LSYM_H
+
+#include <stdint.h>
+
+///////////////////////////////////////////////////////////////////////
+
+// Global symbol table. Every symbol name is stored exactly once, so two
+// interned names are equal if and only if their pointers are equal. The
+// returned string is owned by the table and must not be freed or written.
+
+char* lsym_intern(char* name);
+int lsym_count(void);
+
+// Marks on a name, which live in a byte stored just before it. Names
+// used as a function parameter are marked local; a symbol which isn't
+// can only ever be bound in the global env. The others record what
+// lambda bodies have been folded using the global value of (see
+// lval_fold).
+enum {
+    LSYM_LOCAL = 1,
+    LSYM_FOLDED = 2, // a body was folded using its global value
+    LSYM_VARIES = 4 // rebound since, so not folded on again
+};
+
+void lsym_mark(char* sym, int marks);
+void lsym_mark_local(char* sym);
+
+static inline int lsym_marks(const char* sym)
+{
+    return sym[-1];
+}
+
+static inline int lsym_is_local(const char* sym)
+{
+    return (sym[-1] & LSYM_LOCAL) != 0;
+}
+
+// FNV-1a hash of a name, also used to hash string values
+uint32_t lsym_hash(char* name);
+
+// Free every interned name. Any symbol still referenced is invalidated.
+void lsym_release(void);
+
+#endif
@@ -0,0 +1,902 @@
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "libclisp.h"
+
+#ifndef CLISP_GC
+
+#ifdef CLISP_VM
+static int enabled = 1;
+#else
+static int enabled = 0;
+#endif
+
+// opcodes, each followed by its operands in the code
+enum {
+    LVM_CONST, // k: push constant k
+    LVM_LOAD, // k: push the value of the symbol in constant k
+    LVM_EMPTY, // push ()
+    LVM_CALL, // n: replace the top n values with their application
+    LVM_TAIL_CALL, // n: return the application of the top n values
+
+    // n: as LVM_CALL, for applications of these builtins
+    LVM_ADD,
+    LVM_SUB,
+    LVM_MUL,
+    LVM_DIV,
+    LVM_MOD,
+    LVM_GT,
+    LVM_LT,
+    LVM_GE,
+    LVM_LE,
+    LVM_EQ,
+    LVM_NE,
+    LVM_HEAD,
+    LVM_TAIL,
+
+    // else, slow: with if and a number on top, pop both and go on, or
+    // jump to else if the number is 0. Jump to slow otherwise.
+    LVM_IF,
+    // n slow: with do and n - 1 arguments, none an error, on top, pop
+    // them all and go on to the last argument. Jump to slow otherwise.
+    LVM_DO,
+    LVM_JUMP, // to
+    LVM_LAMBDA, // k: as LVM_CALL 3, giving the function made code k
+    LVM_RETURN
+};
+
+// With computed goto, as GCC and Clang have, code is direct threaded
+// unless built with CLISP_VM_SWITCH (meson -Dvm_dispatch=switch). Before
+// it first runs each opcode is replaced by the address of its handler,
+// and every handler ends jumping to the next one, instead of going back
+// round a switch.
+#if defined(__GNUC__) && !defined(CLISP_VM_SWITCH)
+#define LVM_THREADED
+typedef void* lvm_word;
+#define LVM_INT(w) ((int)(intptr_t)(w))
+#else
+typedef int lvm_word;
+#define LVM_INT(w) (w)
+#endif
+
+// builtins with an opcode, and how many elements an application must
+// have to use it, 0 for any
+typedef struct {
+    char* name;
+    lbuiltin builtin;
+    int count;
+    char* sym; // name, interned on first use
+} lvm_builtin;
+
+static lvm_builtin builtins[] = {
+    [LVM_ADD] = { "+", builtin_add },
+    [LVM_SUB] = { "-", builtin_sub },
+    [LVM_MUL] = { "*", builtin_mul },
+    [LVM_DIV] = { "/", builtin_div },
+    [LVM_MOD] = { "%", builtin_mod },
+    [LVM_GT] = { ">", builtin_gt, 3 },
+    [LVM_LT] = { "<", builtin_lt, 3 },
+    [LVM_GE] = { ">=", builtin_ge, 3 },
+    [LVM_LE] = { "<=", builtin_le, 3 },
+    [LVM_EQ] = { "==", builtin_eq, 3 },
+    [LVM_NE] = { "!=", builtin_ne, 3 },
+    [LVM_HEAD] = { "head", builtin_head, 2 },
+    [LVM_TAIL] = { "tail", builtin_tail, 2 },
+    [LVM_IF] = { "if", builtin_if, 4 },
+    [LVM_DO] = { "do", builtin_do },
+    [LVM_LAMBDA] = { "\\", builtin_lambda, 3 },
+    [LVM_RETURN] = { NULL },
+};
+
+struct lcode {
+    int refs;
+    int depth; // most values on the stack at once
+    int* ops;
+    int count;
+    int capacity;
+    lval** consts;
+    int const_count;
+    int const_capacity;
+    lcode** codes; // of the lambdas this code makes
+    int code_count;
+    int code_capacity;
+    lvm_word* threaded; // ops with handler addresses, once it has run
+};
+
+// the code of a function which has been called once, but not compiled
+static lcode cold;
+
+lcode* lcode_retain(lcode* c)
+{
+    if (c && c != &cold) {
+        c->refs++;
+    }
+    return c;
+}
+
+void lcode_release(lcode* c)
+{
+    if (!c || c == &cold || --c->refs > 0) {
+        return;
+    }
+    for (int i = 0; i < c->const_count; i++) {
+        lval_del(c->consts[i]);
+    }
+    for (int i = 0; i < c->code_count; i++) {
+        lcode_release(c->codes[i]);
+    }
+    free(c->ops);
+    free(c->threaded);
+    free(c->consts);
+    free(c->codes);
+    free(c);
+}
+
+///////////////////////////////////////////////////////////////////////
+
+typedef struct {
+    lcode* code;
+    int sp; // values on the stack where the next op runs
+} lcompiler;
+
+// make room for one more item in an array of capacity items
+static void* lvm_grow(void* items, int count, int* capacity, size_t size)
+{
+    if (count < *capacity) {
+        return items;
+    }
+    *capacity = *capacity ? *capacity * 2 : 8;
+    return realloc(items, size * *capacity);
+}
+
+static void lvm_emit(lcompiler* c, int op)
+{
+    lcode* code = c->code;
+    code->ops = lvm_grow(code->ops, code->count, &code->capacity, sizeof(int));
+    code->ops[code->count++] = op;
+}
+
+// the value of an operand emitted as 0 and filled in by lvm_patch
+static int lvm_label(lcompiler* c)
+{
+    lvm_emit(c, 0);
+    return c->code->count - 1;
+}
+
+// point the operand at label to the next op
+static void lvm_patch(lcompiler* c, int label)
+{
+    c->code->ops[label] = c->code->count;
+}
+
+static void lvm_stack(lcompiler* c, int change)
+{
+    c->sp += change;
+    if (c->sp > c->code->depth) {
+        c->code->depth = c->sp;
+    }
+}
+
+static void lvm_emit_const(lcompiler* c, int op, lval* v)
+{
+    lcode* code = c->code;
+    code->consts = lvm_grow(code->consts, code->const_count, &code->const_capacity, sizeof(lval*));
+    code->consts[code->const_count] = lval_retain(v);
+    lvm_emit(c, op);
+    lvm_emit(c, code->const_count++);
+    lvm_stack(c, 1);
+}
+
+// the opcode for an application of count elements starting with head,
+// a symbol or, in a folded body, the builtin it named
+static int lvm_opcode(lval* head, int count)
+{
+    int type = lval_type(head);
+    if (type != LVAL_SYM && (type != LVAL_FUN || !head->builtin)) {
+        return LVM_CALL;
+    }
+    for (int op = 0; op < sizeof(builtins) / sizeof(builtins[0]); op++) {
+        lvm_builtin* b = &builtins[op];
+        if (!b->name) {
+            continue;
+        }
+        if (!b->sym) {
+            b->sym = lsym_intern(b->name);
+        }
+        int match = type == LVAL_SYM ? b->sym == head->sym : b->builtin == head->builtin;
+        if (match && (!b->count || b->count == count)) {
+            return op;
+        }
+    }
+    return LVM_CALL;
+}
+
+static lcode* lvm_compile_body(lval* body);
+static void lvm_compile_list(lcompiler* c, lval* v, int tail);
+
+// compile v, which is the value code returns if tail is set
+static void lvm_compile_expr(lcompiler* c, lval* v, int tail)
+{
+    switch (lval_type(v)) {
+    case LVAL_SYM:
+        lvm_emit_const(c, LVM_LOAD, v);
+        break;
+    case LVAL_SEXPR:
+        lvm_compile_list(c, v, tail);
+        break;
+    default:
+        lvm_emit_const(c, LVM_CONST, v);
+    }
+}
+
+// the end of a branch of an if, which returns if it is in tail position
+static int lvm_branch_end(lcompiler* c, int tail)
+{
+    if (tail) {
+        lvm_emit(c, LVM_RETURN);
+        return -1;
+    }
+    lvm_emit(c, LVM_JUMP);
+    return lvm_label(c);
+}
+
+// (if cond {then} {else}), with the branches compiled in place
+static void lvm_compile_if(lcompiler* c, lval* v, int tail)
+{
+    lvm_compile_expr(c, v->cell[0], 0);
+    lvm_compile_expr(c, v->cell[1], 0);
+    lvm_emit(c, LVM_IF);
+    int otherwise = lvm_label(c);
+    int slow = lvm_label(c);
+    int sp = c->sp - 2;
+
+    c->sp = sp;
+    lvm_compile_list(c, v->cell[2], tail);
+    int end = lvm_branch_end(c, tail);
+
+    lvm_patch(c, otherwise);
+    c->sp = sp;
+    lvm_compile_list(c, v->cell[3], tail);
+    int end_otherwise = lvm_branch_end(c, tail);
+
+    // if was redefined or the condition isn't a number: apply it
+    lvm_patch(c, slow);
+    c->sp = sp + 2;
+    lvm_emit_const(c, LVM_CONST, v->cell[2]);
+    lvm_emit_const(c, LVM_CONST, v->cell[3]);
+    lvm_emit(c, tail ? LVM_TAIL_CALL : LVM_CALL);
+    lvm_emit(c, 4);
+    lvm_stack(c, -3);
+
+    if (!tail) {
+        lvm_patch(c, end);
+        lvm_patch(c, end_otherwise);
+    }
+}
+
+// (do ...), with the last argument compiled in the place of the call
+static void lvm_compile_do(lcompiler* c, lval* v, int tail)
+{
+    int n = v->count - 1;
+    for (int i = 0; i < n; i++) {
+        lvm_compile_expr(c, v->cell[i], 0);
+    }
+    lvm_emit(c, LVM_DO);
+    lvm_emit(c, n);
+    int slow = lvm_label(c);
+    int sp = c->sp - n;
+
+    c->sp = sp;
+    lvm_compile_expr(c, v->cell[n], tail);
+    int end = lvm_branch_end(c, tail);
+
+    // do was redefined or an argument is an error: apply it
+    lvm_patch(c, slow);
+    c->sp = sp + n;
+    lvm_compile_expr(c, v->cell[n], 0);
+    lvm_emit(c, tail ? LVM_TAIL_CALL : LVM_CALL);
+    lvm_emit(c, v->count);
+    lvm_stack(c, -n);
+
+    if (!tail) {
+        lvm_patch(c, end);
+    }
+}
+
+// (\ {formals} {body}), with the body compiled ahead of time unless it
+// is going to be folded, which leaves it to be compiled once folded
+static void lvm_compile_lambda(lcompiler* c, lval* v)
+{
+    for (int i = 0; i < v->count; i++) {
+        lvm_compile_expr(c, v->cell[i], 0);
+    }
+
+    lcode* code = c->code;
+    code->codes = lvm_grow(code->codes, code->code_count, &code->code_capacity, sizeof(lcode*));
+    code->codes[code->code_count] = lval_fold_enabled() ? NULL : lvm_compile_body(v->cell[2]);
+    lvm_emit(c, LVM_LAMBDA);
+    lvm_emit(c, code->code_count++);
+    lvm_stack(c, -2);
+}
+
+// an S-expression, or a Q-expression evaluated as one
+static void lvm_compile_list(lcompiler* c, lval* v, int tail)
+{
+    if (v->count == 0) {
+        lvm_emit(c, LVM_EMPTY);
+        lvm_stack(c, 1);
+        return;
+    }
+    if (v->count == 1) {
+        lvm_compile_expr(c, v->cell[0], tail);
+        return;
+    }
+
+    int op = lvm_opcode(v->cell[0], v->count);
+
+    if (op == LVM_IF && lval_type(v->cell[2]) == LVAL_QEXPR && lval_type(v->cell[3]) == LVAL_QEXPR) {
+        lvm_compile_if(c, v, tail);
+        return;
+    }
+    if (op == LVM_DO) {
+        lvm_compile_do(c, v, tail);
+        return;
+    }
+    if (op == LVM_LAMBDA && lval_type(v->cell[1]) == LVAL_QEXPR && lval_type(v->cell[2]) == LVAL_QEXPR) {
+        lvm_compile_lambda(c, v);
+        return;
+    }
+    if (op == LVM_IF || op == LVM_LAMBDA) {
+        op = LVM_CALL;
+    }
+    if (op == LVM_CALL && tail) {
+        op = LVM_TAIL_CALL;
+    }
+
+    for (int i = 0; i < v->count; i++) {
+        lvm_compile_expr(c, v->cell[i], 0);
+    }
+    lvm_emit(c, op);
+    lvm_emit(c, v->count);
+    lvm_stack(c, 1 - v->count);
+}
+
+static lcode* lvm_code_new()
+{
+    lcode* code = calloc(1, sizeof(lcode));
+    code->refs = 1;
+    return code;
+}
+
+static lcode* lvm_compile_body(lval* body)
+{
+    lcompiler c = { lvm_code_new(), 0 };
+    lvm_compile_list(&c, body, 1);
+    lvm_emit(&c, LVM_RETURN);
+    return c.code;
+}
+
+///////////////////////////////////////////////////////////////////////
+
+// apply the n values at args, taking them, as lval_eval_sexpr does. In
+// tail position the call is left to lval_eval, see lval_tail_call.
+static lval* lvm_apply(lenv* e, lval** args, int n, int tail)
+{
+    // the first error is the result
+    for (int i = 0; i < n; i++) {
+        if (lval_type(args[i]) == LVAL_ERR) {
+            for (int j = 0; j < n; j++) {
+                if (j != i) {
+                    lval_del(args[j]);
+                }
+            }
+            return args[i];
+        }
+    }
+
+    lval* f = args[0];
+    if (lval_type(f) != LVAL_FUN) {
+        lval* err = lval_err("S-expression must start with a function. Got '%s', expected: '%s'", ltype_name(lval_type(f)), ltype_name(LVAL_FUN));
+        for (int i = 0; i < n; i++) {
+            lval_del(args[i]);
+        }
+        return err;
+    }
+
+    lval* a = lval_sexpr();
+    for (int i = 1; i < n; i++) {
+        lval_add(a, args[i]);
+    }
+    lval* result = tail ? lval_tail_call(e, f, a) : lval_call(e, f, a);
+    lval_del(f);
+    return result;
+}
+
+// whether f is still the builtin op was compiled for
+static int lvm_is(lval* f, int op)
+{
+    return lval_type(f) == LVAL_FUN && f->builtin == builtins[op].builtin;
+}
+
+static void lvm_del_args(lval** args, int n)
+{
+    for (int i = 0; i < n; i++) {
+        // numbers are mostly fixnums, with nothing to free
+        if (!lval_is_fixnum(args[i])) {
+            lval_del(args[i]);
+        }
+    }
+}
+
+// The handlers below apply op to the values at the top of the stack,
+// leaving the result in their place, and return the new top.
+
+static lval** lvm_arith(lenv* e, int op, lval** sp, int n)
+{
+    lval** args = sp - n;
+    if (!lvm_is(args[0], op)) {
+        *args = lvm_apply(e, args, n, 0);
+        return args + 1;
+    }
+    for (int i = 1; i < n; i++) {
+        if (lval_type(args[i]) != LVAL_NUM) {
+            *args = lvm_apply(e, args, n, 0);
+            return args + 1;
+        }
+        // the builtin reports division by zero
+        if (i > 1 && (op == LVM_DIV || op == LVM_MOD) && lval_to_num(args[i]) == 0) {
+            *args = lvm_apply(e, args, n, 0);
+            return args + 1;
+        }
+    }
+
+    long x = lval_to_num(args[1]);
+    if (op == LVM_SUB && n == 2) {
+        x = -x;
+    }
+    for (int i = 2; i < n; i++) {
+        long y = lval_to_num(args[i]);
+        switch (op) {
+        case LVM_ADD:
+            x += y;
+            break;
+        case LVM_SUB:
+            x -= y;
+            break;
+        case LVM_MUL:
+            x *= y;
+            break;
+        case LVM_DIV:
+            x /= y;
+            break;
+        case LVM_MOD:
+            x %= y;
+            break;
+        }
+    }
+    lvm_del_args(args, n);
+    *args = lval_num(x);
+    return args + 1;
+}
+
+static lval** lvm_ord(lenv* e, int op, lval** sp)
+{
+    lval** args = sp - 3;
+    if (!lvm_is(args[0], op) || lval_type(args[1]) != LVAL_NUM || lval_type(args[2]) != LVAL_NUM) {
+        *args = lvm_apply(e, args, 3, 0);
+        return args + 1;
+    }
+
+    long x = lval_to_num(args[1]);
+    long y = lval_to_num(args[2]);
+    int r = 0;
+    switch (op) {
+    case LVM_GT:
+        r = x > y;
+        break;
+    case LVM_LT:
+        r = x < y;
+        break;
+    case LVM_GE:
+        r = x >= y;
+        break;
+    case LVM_LE:
+        r = x <= y;
+        break;
+    }
+    lvm_del_args(args, 3);
+    *args = lval_num(r);
+    return args + 1;
+}
+
+static lval** lvm_cmp(lenv* e, int op, lval** sp)
+{
+    lval** args = sp - 3;
+    if (!lvm_is(args[0], op) || lval_type(args[1]) == LVAL_ERR || lval_type(args[2]) == LVAL_ERR) {
+        *args = lvm_apply(e, args, 3, 0);
+        return args + 1;
+    }
+
+    int r = lval_eq(args[1], args[2]);
+    lvm_del_args(args, 3);
+    *args = lval_num(op == LVM_EQ ? r : !r);
+    return args + 1;
+}
+
+static lval** lvm_slice(lenv* e, int op, lval** sp)
+{
+    lval** args = sp - 2;
+    lval* v = args[1];
+    if (!lvm_is(args[0], op) || lval_type(v) != LVAL_QEXPR || v->count == 0) {
+        *args = lvm_apply(e, args, 2, 0);
+        return args + 1;
+    }
+
+    lval_del(args[0]);
+    *args = op == LVM_HEAD ? lval_slice(v, 0, 1) : lval_slice(v, 1, v->count - 1);
+    return args + 1;
+}
+
+// instructions run, see lvm_get_stats
+static long instructions;
+
+#ifdef LVM_THREADED
+// how many operands follow each opcode
+static const int operands[] = {
+    [LVM_CONST] = 1,
+    [LVM_LOAD] = 1,
+    [LVM_EMPTY] = 0,
+    [LVM_CALL] = 1,
+    [LVM_TAIL_CALL] = 1,
+    [LVM_ADD] = 1,
+    [LVM_SUB] = 1,
+    [LVM_MUL] = 1,
+    [LVM_DIV] = 1,
+    [LVM_MOD] = 1,
+    [LVM_GT] = 1,
+    [LVM_LT] = 1,
+    [LVM_GE] = 1,
+    [LVM_LE] = 1,
+    [LVM_EQ] = 1,
+    [LVM_NE] = 1,
+    [LVM_HEAD] = 1,
+    [LVM_TAIL] = 1,
+    [LVM_IF] = 2,
+    [LVM_DO] = 2,
+    [LVM_JUMP] = 1,
+    [LVM_LAMBDA] = 1,
+    [LVM_RETURN] = 0,
+};
+
+// replace the opcodes of code with the addresses of their handlers
+static void lvm_thread(lcode* code, void* const* handlers)
+{
+    lvm_word* threaded = malloc(sizeof(lvm_word) * code->count);
+    for (int i = 0; i < code->count;) {
+        int op = code->ops[i];
+        threaded[i++] = handlers[op];
+        for (int j = 0; j < operands[op]; j++, i++) {
+            threaded[i] = (lvm_word)(intptr_t)code->ops[i];
+        }
+    }
+    code->threaded = threaded;
+}
+
+#define LVM_OP(op) op_##op:
+#define LVM_DISPATCH() goto* (ran++, *pc++);
+#define LVM_NEXT() goto* (ran++, *pc++)
+#else
+#define LVM_OP(op) case op:
+#define LVM_DISPATCH() \
+    ran++;             \
+    switch (*pc++)
+#define LVM_NEXT() continue
+#endif
+
+#define LVM_ARG() LVM_INT(*pc++)
+
+static lval* lvm_run(lenv* e, lcode* code)
+{
+#ifdef LVM_THREADED
+    static void* const handlers[] = {
+        [LVM_CONST] = &&op_LVM_CONST,
+        [LVM_LOAD] = &&op_LVM_LOAD,
+        [LVM_EMPTY] = &&op_LVM_EMPTY,
+        [LVM_CALL] = &&op_LVM_CALL,
+        [LVM_TAIL_CALL] = &&op_LVM_TAIL_CALL,
+        [LVM_ADD] = &&op_LVM_ADD,
+        [LVM_SUB] = &&op_LVM_SUB,
+        [LVM_MUL] = &&op_LVM_MUL,
+        [LVM_DIV] = &&op_LVM_DIV,
+        [LVM_MOD] = &&op_LVM_MOD,
+        [LVM_GT] = &&op_LVM_GT,
+        [LVM_LT] = &&op_LVM_LT,
+        [LVM_GE] = &&op_LVM_GE,
+        [LVM_LE] = &&op_LVM_LE,
+        [LVM_EQ] = &&op_LVM_EQ,
+        [LVM_NE] = &&op_LVM_NE,
+        [LVM_HEAD] = &&op_LVM_HEAD,
+        [LVM_TAIL] = &&op_LVM_TAIL,
+        [LVM_IF] = &&op_LVM_IF,
+        [LVM_DO] = &&op_LVM_DO,
+        [LVM_JUMP] = &&op_LVM_JUMP,
+        [LVM_LAMBDA] = &&op_LVM_LAMBDA,
+        [LVM_RETURN] = &&op_LVM_RETURN,
+    };
+    if (!code->threaded) {
+        lvm_thread(code, handlers);
+    }
+    lvm_word* ops = code->threaded;
+#else
+    lvm_word* ops = code->ops;
+#endif
+
+    lval** stack = lalloc_push(sizeof(lval*) * code->depth);
+    lval** sp = stack;
+    lvm_word* pc = ops;
+    long ran = 0;
+
+    while (1) {
+        LVM_DISPATCH() {
+        LVM_OP(LVM_CONST) {
+            lval* v = code->consts[LVM_ARG()];
+            *sp++ = lval_is_fixnum(v) ? v : lval_retain(v);
+            LVM_NEXT();
+        }
+        LVM_OP(LVM_LOAD)
+            *sp++ = lenv_get(e, code->consts[LVM_ARG()]);
+            LVM_NEXT();
+        LVM_OP(LVM_EMPTY)
+            *sp++ = lval_sexpr();
+            LVM_NEXT();
+        LVM_OP(LVM_CALL) {
+            int n = LVM_ARG();
+            sp -= n;
+            *sp = lvm_apply(e, sp, n, 0);
+            sp++;
+            LVM_NEXT();
+        }
+        LVM_OP(LVM_TAIL_CALL) {
+            int n = LVM_ARG();
+            lval* result = lvm_apply(e, sp - n, n, 1);
+            lalloc_pop(stack);
+            instructions += ran;
+            return result;
+        }
+        LVM_OP(LVM_ADD)
+            sp = lvm_arith(e, LVM_ADD, sp, LVM_ARG());
+            LVM_NEXT();
+        LVM_OP(LVM_SUB)
+            sp = lvm_arith(e, LVM_SUB, sp, LVM_ARG());
+            LVM_NEXT();
+        LVM_OP(LVM_MUL)
+            sp = lvm_arith(e, LVM_MUL, sp, LVM_ARG());
+            LVM_NEXT();
+        LVM_OP(LVM_DIV)
+            sp = lvm_arith(e, LVM_DIV, sp, LVM_ARG());
+            LVM_NEXT();
+        LVM_OP(LVM_MOD)
+            sp = lvm_arith(e, LVM_MOD, sp, LVM_ARG());
+            LVM_NEXT();
+        LVM_OP(LVM_GT)
+            pc++;
+            sp = lvm_ord(e, LVM_GT, sp);
+            LVM_NEXT();
+        LVM_OP(LVM_LT)
+            pc++;
+            sp = lvm_ord(e, LVM_LT, sp);
+            LVM_NEXT();
+        LVM_OP(LVM_GE)
+            pc++;
+            sp = lvm_ord(e, LVM_GE, sp);
+            LVM_NEXT();
+        LVM_OP(LVM_LE)
+            pc++;
+            sp = lvm_ord(e, LVM_LE, sp);
+            LVM_NEXT();
+        LVM_OP(LVM_EQ)
+            pc++;
+            sp = lvm_cmp(e, LVM_EQ, sp);
+            LVM_NEXT();
+        LVM_OP(LVM_NE)
+            pc++;
+            sp = lvm_cmp(e, LVM_NE, sp);
+            LVM_NEXT();
+        LVM_OP(LVM_HEAD)
+            pc++;
+            sp = lvm_slice(e, LVM_HEAD, sp);
+            LVM_NEXT();
+        LVM_OP(LVM_TAIL)
+            pc++;
+            sp = lvm_slice(e, LVM_TAIL, sp);
+            LVM_NEXT();
+        LVM_OP(LVM_IF) {
+            lval* f = sp[-2];
+            lval* x = sp[-1];
+            if (!lvm_is(f, LVM_IF) || lval_type(x) != LVAL_NUM) {
+                pc = ops + LVM_INT(pc[1]);
+                LVM_NEXT();
+            }
+            long cond = lval_to_num(x);
+            lval_del(f);
+            lval_del(x);
+            sp -= 2;
+            pc = cond ? pc + 2 : ops + LVM_INT(pc[0]);
+            LVM_NEXT();
+        }
+        LVM_OP(LVM_DO) {
+            int n = LVM_ARG();
+            lval** args = sp - n;
+            int fast = lvm_is(args[0], LVM_DO);
+            for (int i = 1; fast && i < n; i++) {
+                fast = lval_type(args[i]) != LVAL_ERR;
+            }
+            if (!fast) {
+                pc = ops + LVM_INT(*pc);
+                LVM_NEXT();
+            }
+            lvm_del_args(args, n);
+            sp = args;
+            pc++;
+            LVM_NEXT();
+        }
+        LVM_OP(LVM_JUMP)
+            pc = ops + LVM_INT(*pc);
+            LVM_NEXT();
+        LVM_OP(LVM_LAMBDA) {
+            lcode* body_code = code->codes[LVM_ARG()];
+            sp -= 3;
+            lval* body = sp[2];
+            lval* f;
+            if (lvm_is(sp[0], LVM_LAMBDA)) {
+                // both arguments are Q-expression constants, so the
+                // builtin's signature needs no checking
+                lval* a = lval_add(lval_add(lval_sexpr(), sp[1]), sp[2]);
+                lval_del(sp[0]);
+                f = builtin_lambda(e, a);
+            } else {
+                f = lvm_apply(e, sp, 3, 0);
+            }
+
+            // the body's code is ready if the function was made from it,
+            // and runs it as it is
+            if (lval_type(f) == LVAL_FUN && !f->builtin && f->body == body && !f->folded
+                && (!f->code || f->code == &cold)) {
+                f->code = lcode_retain(body_code);
+            }
+            *sp++ = f;
+            LVM_NEXT();
+        }
+        LVM_OP(LVM_RETURN) {
+            lval* result = *--sp;
+            lalloc_pop(stack);
+            instructions += ran;
+            return result;
+        }
+        }
+    }
+}
+
+///////////////////////////////////////////////////////////////////////
+
+void lvm_enable(int on)
+{
+    enabled = on;
+}
+
+int lvm_enabled(void)
+{
+    return enabled;
+}
+
+char* lvm_dispatch_name(void)
+{
+#ifdef LVM_THREADED
+    return "threaded";
+#else
+    return "switch";
+#endif
+}
+
+lvm_stats lvm_get_stats(void)
+{
+    lvm_stats stats = { instructions };
+    return stats;
+}
+
+char* lvm_name(void)
+{
+    if (leval_enabled()) {
+        return "stack";
+    }
+    return enabled ? "vm" : "tree-walker";
+}
+
+lval* lvm_eval(lenv* e, lval* v)
+{
+    if (!enabled || leval_enabled()) {
+        return lval_eval(e, v);
+    }
+
+    lcompiler c = { lvm_code_new(), 0 };
+    lvm_compile_expr(&c, v, 0);
+    lvm_emit(&c, LVM_RETURN);
+    lval_del(v);
+
+    lval* result = lvm_run(e, c.code);
+    lcode_release(c.code);
+    return result;
+}
+
+lval* lvm_call(lenv* frame, lval* f)
+{
+    // folding f's body again drops the code compiled from it
+    lval* body = lval_body(frame, f);
+
+    // a function only called once, as the ones made by let are, isn't
+    // worth compiling, so its first call is left to lval_eval
+    if (!f->code) {
+        f->code = &cold;
+        body = lval_unshare(lval_retain(body));
+        body->type = LVAL_SEXPR;
+        return lval_tail(body);
+    }
+    if (f->code == &cold) {
+        f->code = lvm_compile_body(body);
+    }
+
+    // the code is held while it runs, as a call within it could fold
+    // the body again and drop it from f
+    lcode* code = lcode_retain(f->code);
+    lval* result = lvm_run(frame, code);
+    lcode_release(code);
+    return result;
+}
+
+#else
+
+void lvm_enable(int on)
+{
+}
+
+int lvm_enabled(void)
+{
+    return 0;
+}
+
+char* lvm_name(void)
+{
+    return "tree-walker";
+}
+
+char* lvm_dispatch_name(void)
+{
+    return "none";
+}
+
+lvm_stats lvm_get_stats(void)
+{
+    lvm_stats stats = { 0 };
+    return stats;
+}
+
+lval* lvm_eval(lenv* e, lval* v)
+{
+    return lval_eval(e, v);
+}
+
+lval* lvm_call(lenv* frame, lval* f)
+{
+    return lval_err("No vm in a build with a collector");
+}
+
+lcode* lcode_retain(lcode* c)
+{
+    return c;
+}
+
+void lcode_release(lcode* c)
+{
+}
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef LIB_CLISP_LVM_H
+#define LIB_CLISP_LVM_H
+
+///////////////////////////////////////////////////////////////////////
+
+struct lval;
+struct lenv;
+
+// Bytecode engine, used instead of the tree-walking lval_eval to run
+// the bodies of user functions when libclisp is built with CLISP_VM
+// (meson -Dengine=vm), or once lvm_enable(1) is called.
+//
+// A body is compiled the first time its function is called, after it
+// has been folded (see lval_body), and again once it is folded again.
+// Each S-expression becomes code pushing its elements onto a value
+// stack, then an instruction applying them. Applications of +, if, do,
+// head and a few other builtins, by name or folded in, get opcodes of
+// their own. These check at run time that the function applied is
+// still that builtin and that the arguments are ones they handle, so
+// the builtin's signature needn't be checked again, and otherwise make
+// the call lval_eval would. Errors are values here as they are in
+// lval_eval, so both engines give the same results.
+//
+// The collector can't see the value stack or the constants code holds,
+// so builds with CLISP_GC always use lval_eval.
+
+typedef struct lcode lcode;
+
+void lvm_enable(int on);
+int lvm_enabled(void);
+char* lvm_name(void);
+
+// how instructions are dispatched: "threaded" with computed goto, else
+// "switch" (see CLISP_VM_SWITCH)
+char* lvm_dispatch_name(void);
+
+typedef struct {
+    long instructions; // run since the start
+} lvm_stats;
+
+lvm_stats lvm_get_stats(void);
+
+// Evaluate v in e with the enabled engine. The vm compiles v for this
+// one run, which suits top-level forms.
+struct lval* lvm_eval(struct lenv* e, struct lval* v);
+
+// Evaluate the body of the user function f in frame, which has f's
+// arguments bound, up to a call in tail position (see lval_tail). Only
+// for lval_eval, while the vm is enabled.
+struct lval* lvm_call(struct lenv* frame, struct lval* f);
+
+lcode* lcode_retain(lcode* c);
+void lcode_release(lcode* c);
+
+#endif
@@ -15,7 +15,7 @@ int main(int argc, char** argv)
 
     // load the stdlib
     lval* result = lval_load(env, "lib/std.lspy");
-    if (result->type == LVAL_ERR) {
+    if (lval_type(result) == LVAL_ERR) {
         lval_println(result);
     }
     lval_del(result);
@@ -31,7 +31,7 @@ int main(int argc, char** argv)
             mpc_result_t r;
             if (mpc_parse("<stdin>", input, grammar->lispy, &r)) {
                 lval* x = lval_read(r.output);
-                x = lval_eval(env, x);
+                x = lvm_eval(env, x);
                 lval_println(x);
 
                 lval_del(x);
@@ -46,7 +46,7 @@ int main(int argc, char** argv)
     } else {
         for (int i = 1; i < argc; i++) {
             lval* result = lval_load(env, argv[i]);
-            if (result->type == LVAL_ERR) {
+            if (lval_type(result) == LVAL_ERR) {
                 lval_println(result);
             }
             lval_del(result);
@@ -55,5 +55,8 @@ int main(int argc, char** argv)
 
     lenv_del(env);
     lgrammar_del(grammar);
+    lgc_release();
+    lsym_release();
+    lalloc_release();
     return 0;
 }
\ No newline at end of file